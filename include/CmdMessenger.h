@@ -31,6 +31,8 @@ extern "C"
 {
   // callback functions always follow the signature: void cmd(void);
   typedef void (*messengerCallbackFunction)(void);
+  // acknowledge callbacks follow the signature: void ack(byte ackCmdId, bool received);
+  typedef void (*messengerAckCallbackFunction)(byte, bool);
 }
 
 #ifndef MAXCALLBACKS
@@ -45,6 +47,25 @@ extern "C"
 #ifndef DEFAULT_TIMEOUT
 #define DEFAULT_TIMEOUT 5000 // Time out on unanswered messages. (default: 5s)
 #endif
+#ifndef MAXTXBUFFERSIZE
+#define MAXTXBUFFERSIZE 64 // The length of the transmit staging buffer (default: 64)
+#endif
+#ifndef MAXPENDINGACKS
+#define MAXPENDINGACKS 4 // The maximum number of acknowledges waited on at once (default: 4)
+#endif
+#ifndef MAXCOMMANDSPERFEED
+#define MAXCOMMANDSPERFEED 8 // The maximum number of commands dispatched per feedinSerialData() (default: 8)
+#endif
+#ifndef MAXBYTESPERFEED
+#define MAXBYTESPERFEED 64 // The maximum number of bytes processed per feedinSerialData() (default: 64)
+#endif
+#ifndef MAXARGUMENTS
+#define MAXARGUMENTS 16 // The maximum number of fields per command, including the command ID (default: 16)
+#endif
+
+#if MAXARGUMENTS > 16
+#error MAXARGUMENTS must be 16 or less to fit the escaped field bitmask
+#endif
 
 // Message States
 enum
@@ -57,6 +78,45 @@ enum
 #define white_space(c) ((c) == ' ' || (c) == '\t')
 #define valid_digit(c) ((c) >= '0' && (c) <= '9')
 
+/**
+ * Staging buffer for outgoing data. Everything printed while a command is being
+ * sent is collected here and handed to the stream in a single write() when the
+ * buffer is flushed, instead of one print() per field or character. Bytes the
+ * stream has no room for can be held back and sent by a later flush.
+ */
+class CmdTxBuffer : public Print
+{
+private:
+  Stream *comms;                // Serial data stream the buffer is flushed to
+  uint8_t length;               // Number of bytes waiting to be sent
+  char buffer[MAXTXBUFFERSIZE]; // Bytes waiting to be sent
+  bool backlogged;              // Indicates if the last flushAvailable() couldn't send everything
+  unsigned long blockedMicros;  // Total time spent waiting for the stream to take a full buffer
+
+  void makeRoom();
+
+public:
+  void init(Stream &comms);
+  void flushBuffer();
+  void flushAvailable();
+  bool isBacklogged() { return backlogged; }
+  unsigned long getBlockedMicros() { return blockedMicros; }
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t *data, size_t size) override;
+  using Print::write;
+};
+
+/**
+ * An acknowledge that is being waited on
+ */
+struct CmdPendingAck
+{
+  bool active;          // Indicates if this slot is waiting on an acknowledge
+  byte ackCmdId;        // Command ID of the expected acknowledge
+  unsigned int timeout; // Time to wait for the acknowledge, in milliseconds
+  unsigned long sentAt; // Time the command requesting the acknowledge was sent
+};
+
 class CmdMessenger
 {
 private:
@@ -67,26 +127,46 @@ private:
   uint8_t bufferIndex;                     // Index where to write data in buffer
   uint8_t bufferLength;                    // Is set to MESSENGERBUFFERSIZE
   uint8_t bufferLastIndex;                 // The last index of the buffer
-  char ArglastChar;                        // Bookkeeping of argument escape char
   char CmdlastChar;                        // Bookkeeping of command escape char
   bool pauseProcessing;                    // pauses processing of new commands, during sending
   bool print_newlines;                     // Indicates if \r\n should be added after send command
+  bool buffer_commands;                    // Indicates if sent commands are held until flushCommands()
   char commandBuffer[MESSENGERBUFFERSIZE]; // Buffer that holds the data
   char streamBuffer[MAXSTREAMBUFFERSIZE];  // Buffer that holds the data
+  uint16_t streamIndex;                    // Next byte in streamBuffer to process
+  uint16_t streamLength;                   // Number of bytes read into streamBuffer
   uint8_t messageState;                    // Current state of message processing
   bool dumped;                             // Indicates if last argument has been externally read
   bool ArgOk;                              // Indicated if last fetched argument could be read
   char *current;                           // Pointer to current buffer position
-  char *last;                              // Pointer to previous buffer position
+  bool currentEscaped;                     // Indicates if the current argument contains escape characters
+  uint8_t argOffsets[MAXARGUMENTS];        // Start of each field in commandBuffer, recorded as bytes arrive
+  uint16_t rxArgEscaped;                   // Bitmask of fields that contain escape characters, while receiving
+  uint8_t rxArgCount;                      // Number of fields recorded so far, while receiving
+  uint16_t argEscaped;                     // Bitmask of fields that contain escape characters in the received command
+  uint8_t argCount;                        // Number of fields in the received command
+  uint8_t argIndex;                        // Index of the next field to return from next()
   char prevChar;                           // Previous char (needed for unescaping)
   Stream *comms;                           // Serial data stream
+  CmdTxBuffer txBuffer;                    // Staging buffer for outgoing commands
+  uint16_t droppedCommands;                // Number of low priority commands dropped while backlogged
+  uint32_t commandsReceived;               // Number of commands received
+  uint32_t commandsSent;                   // Number of commands sent
+  uint16_t overflowResets;                 // Number of received commands lost for not fitting in commandBuffer
+  uint16_t unknownCommands;                // Number of received commands with no callback attached
 
   char command_separator; // Character indicating end of command (default: ';')
   char field_separator;   // Character indicating end of argument (default: ',')
   char escape_character;  // Character indicating escaping of special chars
 
   messengerCallbackFunction default_callback;           // default callback function
+  messengerAckCallbackFunction ack_callback;            // callback for received and timed out acknowledges
+  CmdPendingAck pendingAcks[MAXPENDINGACKS];            // acknowledges being waited on
+#if MAXCALLBACKS > 0
   messengerCallbackFunction callbackList[MAXCALLBACKS]; // list of attached callback functions
+#endif
+  const messengerCallbackFunction *progmemCallbacks;    // table of callback functions stored in PROGMEM
+  uint8_t progmemCallbackCount;                         // number of entries in progmemCallbacks
 
   // **** Initialize ****
 
@@ -97,8 +177,9 @@ private:
 
   inline uint8_t processLine(char serialChar) __attribute__((always_inline));
   inline void handleMessage() __attribute__((always_inline));
-  inline bool blockedTillReply(unsigned int timeout = DEFAULT_TIMEOUT, byte ackCmdId = 1) __attribute__((always_inline));
-  inline bool checkForAck(byte AckCommand) __attribute__((always_inline));
+  bool addPendingAck(byte ackCmdId, unsigned int timeout);
+  bool matchPendingAck(byte ackCmdId);
+  void checkAckTimeouts();
 
   // **** Command sending ****
 
@@ -118,16 +199,15 @@ private:
 
   // **** Command receiving ****
 
-  int findNext(char *str, char delim);
-
   /**
 	 * Read a variable of any type in binary format
 	 */
   template <class T>
-  T readBin(char *str)
+  T readBin(char *str, bool escaped)
   {
     T value;
-    unescape(str);
+    if (escaped)
+      unescape(str);
     byte *bytePointer = (byte *)(const void *)&value;
     for (unsigned int i = 0; i < sizeof(value); i++)
     {
@@ -152,7 +232,6 @@ private:
 
   // **** Escaping tools ****
 
-  char *split_r(char *str, const char delim, char **nextp);
   bool isEscaped(char *currChar, const char escapeChar, char *lastChar);
 
   void printEsc(char *str);
@@ -168,8 +247,14 @@ public:
                const char esc_character = '/');
 
   void printLfCr(bool addNewLine = true);
+  void bufferCommands(bool enable = true);
   void attach(messengerCallbackFunction newFunction);
+#if MAXCALLBACKS > 0
+  // Not available without a callback list, so attaching to an ID fails to compile rather than doing nothing.
   void attach(byte msgId, messengerCallbackFunction newFunction);
+#endif
+  void attach(const messengerCallbackFunction *callbacks, uint8_t count);
+  void attachAck(messengerAckCallbackFunction newFunction);
 
   // **** Command processing ****
 
@@ -215,6 +300,27 @@ public:
     return false;
   }
 
+  /**
+	 * Send a command with a single argument of any type, unless the stream is
+	 * backlogged. Use this for messages that can be lost without harm, such as
+	 * acknowledging a command. Returns true if the command was sent.
+	 */
+  template <class T>
+  bool sendLowPriorityCmd(byte cmdId, T arg)
+  {
+    if (startCommand)
+      return false;
+    if (txBuffer.isBacklogged())
+    {
+      droppedCommands++;
+      return false;
+    }
+    sendCmdStart(cmdId);
+    sendCmdArg(arg);
+    sendCmdEnd();
+    return true;
+  }
+
   bool sendCmd(byte cmdId);
   bool sendCmd(byte cmdId, bool reqAc, byte ackCmdId);
   // **** Command sending with multiple arguments ****
@@ -223,6 +329,14 @@ public:
   void sendCmdEscArg(char *arg);
   void sendCmdfArg(char *fmt, ...);
   bool sendCmdEnd(bool reqAc = false, byte ackCmdId = 1, unsigned int timeout = DEFAULT_TIMEOUT);
+  void flushCommands();
+  bool isTxBacklogged();
+  unsigned long getTxBlockedMicros();
+  uint16_t getDroppedCommands();
+  uint32_t getCommandsReceived();
+  uint32_t getCommandsSent();
+  uint16_t getOverflowResets();
+  uint16_t getUnknownCommands();
 
   /**
 	 * Send the field separator
@@ -232,7 +346,7 @@ public:
   {
     if (startCommand)
     {
-      comms->print(field_separator);
+      txBuffer.print(field_separator);
     }
   }
 
@@ -245,8 +359,8 @@ public:
   {
     if (startCommand)
     {
-      comms->print(field_separator);
-      comms->print(arg);
+      txBuffer.print(field_separator);
+      txBuffer.print(arg);
     }
   }
 
@@ -259,7 +373,7 @@ public:
   {
     if (startCommand)
     {
-      comms->print(arg);
+      txBuffer.print(arg);
     }
   }
 
@@ -272,8 +386,8 @@ public:
   {
     if (startCommand)
     {
-      comms->print(field_separator);
-      comms->print(arg, n);
+      txBuffer.print(field_separator);
+      txBuffer.print(arg, n);
     }
   }
 
@@ -286,7 +400,7 @@ public:
   {
     if (startCommand)
     {
-      comms->print(arg, n);
+      txBuffer.print(arg, n);
     }
   }
 
@@ -311,7 +425,7 @@ public:
   {
     if (startCommand)
     {
-      comms->print(field_separator);
+      txBuffer.print(field_separator);
       writeBin(arg);
     }
   }
@@ -349,7 +463,7 @@ public:
     if (next())
     {
       dumped = true;
-      return readBin<T>(current);
+      return readBin<T>(current, currentEscaped);
     }
     else
     {
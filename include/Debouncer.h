@@ -0,0 +1,104 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Number of consecutive scans an input has to read the same value before its
+// debounced state changes.
+static constexpr uint8_t DEBOUNCE_SAMPLES = 4;
+
+/**
+ * @brief Debounces every bit of an input word in parallel. The last few samples are kept
+ * and a bit only takes on a new value once it has read that value in every one of them,
+ * so filtering all the inputs costs a handful of word-wide AND/OR operations per scan
+ * no matter how many inputs there are.
+ *
+ * @tparam T Unsigned integer type holding one bit per input.
+ * @tparam Samples Number of identical samples required for a change.
+ */
+template <typename T, uint8_t Samples = DEBOUNCE_SAMPLES>
+class Debouncer
+{
+  static_assert(Samples > 0, "Debouncer needs at least one sample");
+
+private:
+  T _history[Samples];
+  uint8_t _next = 0;
+  bool _settled = true;
+  T _state;
+
+public:
+  /**
+   * @brief Construct a new Debouncer object
+   *
+   * @param initialState The debounced state to start from.
+   */
+  explicit Debouncer(T initialState)
+  {
+    Reset(initialState);
+  }
+
+  /**
+   * @brief Sets the debounced state and fills the sample history with it.
+   *
+   * @param state The new debounced state.
+   */
+  void Reset(T state)
+  {
+    for (auto i = 0; i < Samples; i++)
+    {
+      _history[i] = state;
+    }
+    _next = 0;
+    _settled = true;
+    _state = state;
+  }
+
+  /**
+   * @brief Adds a sample and updates the debounced state.
+   *
+   * @param sample The raw state of all the inputs.
+   * @return T The debounced state of all the inputs.
+   */
+  T Update(T sample)
+  {
+    _history[_next] = sample;
+    if (++_next == Samples)
+    {
+      _next = 0;
+    }
+
+    T allHigh = static_cast<T>(~0);
+    T anyHigh = 0;
+    for (auto i = 0; i < Samples; i++)
+    {
+      allHigh &= _history[i];
+      anyHigh |= _history[i];
+    }
+
+    // Bits that were high in every sample go high, bits that were low in every
+    // sample go low, and bits that are still bouncing keep their previous state.
+    _state = (_state & anyHigh) | allHigh;
+    _settled = (allHigh == anyHigh);
+
+    return _state;
+  }
+
+  /**
+   * @brief Returns true when every input has read the same value for the whole
+   * history, meaning further samples of unchanged inputs can't change the state.
+   *
+   */
+  bool IsSettled() const
+  {
+    return _settled;
+  }
+
+  /**
+   * @brief Returns the current debounced state of all the inputs.
+   *
+   */
+  T State() const
+  {
+    return _state;
+  }
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Detents further apart than this are treated as the start of a new turn.
+static constexpr uint16_t DETENT_IDLE_INTERVAL_MS = 250;
+
+// One point on an acceleration curve. Detents arriving at most maxInterval
+// milliseconds apart move the value by multiplier steps each. Curves are stored
+// in PROGMEM, sorted by increasing maxInterval, and must end with an entry
+// that has a maxInterval of UINT16_MAX.
+struct AccelerationStep
+{
+  uint16_t maxInterval;
+  uint8_t multiplier;
+};
+
+// Curve used by encoders that don't specify their own.
+extern const AccelerationStep DefaultAccelerationCurve[] PROGMEM;
+
+/**
+ * @brief Looks up the multiplier for a detent interval on an acceleration curve.
+ *
+ * @param curve The acceleration curve, in PROGMEM.
+ * @param interval The average time between detents in milliseconds.
+ * @return uint8_t The number of steps each detent is worth.
+ */
+inline uint8_t GetAccelerationMultiplier(const AccelerationStep *curve, uint16_t interval)
+{
+  while (interval > pgm_read_word(&curve->maxInterval))
+  {
+    curve++;
+  }
+
+  return pgm_read_byte(&curve->multiplier);
+}
+
+/**
+ * @brief Estimates how fast an encoder is turning from the time between its detents.
+ * The estimate is a running average so a single early or late detent doesn't make
+ * the acceleration jump, and it starts over whenever the turn pauses or reverses so
+ * the first detent of every turn is always a single step.
+ *
+ * It only depends on the timestamps it's given, so it can be driven from recorded
+ * timing traces as well as from the encoder.
+ */
+class DetentVelocity
+{
+private:
+  uint32_t _lastDetentMs = 0;
+  uint16_t _interval = DETENT_IDLE_INTERVAL_MS;
+  int8_t _direction = 0;
+
+public:
+  /**
+   * @brief Records a detent.
+   *
+   * @param ms The time the detent was detected.
+   * @param direction 1 or -1 for the direction of the turn.
+   */
+  void Detent(uint32_t ms, int8_t direction)
+  {
+    uint32_t interval = ms - _lastDetentMs;
+
+    // Detents found by the main loop are stamped with the time the pass started,
+    // which can be a moment before a detent the pin change interrupt just stamped.
+    // Those count as simultaneous rather than as a wrap around.
+    if (_lastDetentMs - ms < DETENT_IDLE_INTERVAL_MS)
+    {
+      interval = 0;
+      ms = _lastDetentMs;
+    }
+    _lastDetentMs = ms;
+
+    if (direction != _direction || interval >= DETENT_IDLE_INTERVAL_MS)
+    {
+      _direction = direction;
+      _interval = DETENT_IDLE_INTERVAL_MS;
+      return;
+    }
+
+    _interval = (_interval + interval) / 2;
+  }
+
+  /**
+   * @brief Returns the average time between recent detents in milliseconds.
+   *
+   */
+  uint16_t Interval() const
+  {
+    return _interval;
+  }
+};
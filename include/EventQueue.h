@@ -0,0 +1,82 @@
+#pragma once
+
+#include <Arduino.h>
+#include <util/atomic.h>
+
+/**
+ * @brief Fixed size ring buffer handing events from one producer to one consumer
+ * without locking. The producer only ever writes the tail and the consumer only
+ * ever writes the head, so an interrupt can push while the main loop pops, or the
+ * other way round. Events that don't fit are dropped and counted.
+ *
+ * @tparam T Type of the events, copied in and out by value.
+ * @tparam Length Number of events the queue holds. Must be a power of two no larger than 128.
+ */
+template <typename T, uint8_t Length>
+class EventQueue
+{
+  static_assert(Length > 0 && Length <= 128 && (Length & (Length - 1)) == 0,
+                "EventQueue length must be a power of two no larger than 128");
+
+private:
+  T _events[Length];
+
+  // Free running indexes, masked down on every access so full and empty can be told apart.
+  volatile uint8_t _head = 0; // Next event to pop.
+  volatile uint8_t _tail = 0; // Next free slot.
+  volatile uint16_t _overflows = 0;
+
+public:
+  /**
+   * @brief Adds an event to the back of the queue. Only call this from the producer.
+   *
+   * @param event The event to add.
+   * @return true if the event was queued, false if the queue was full and it was dropped.
+   */
+  bool Push(const T &event)
+  {
+    uint8_t tail = _tail;
+    if (static_cast<uint8_t>(tail - _head) == Length)
+    {
+      _overflows++;
+      return false;
+    }
+
+    _events[tail & (Length - 1)] = event;
+    _tail = tail + 1;
+    return true;
+  }
+
+  /**
+   * @brief Removes the event at the front of the queue. Only call this from the consumer.
+   *
+   * @param event Set to the removed event.
+   * @return true if there was an event to remove.
+   */
+  bool Pop(T &event)
+  {
+    uint8_t head = _head;
+    if (head == _tail)
+    {
+      return false;
+    }
+
+    event = _events[head & (Length - 1)];
+    _head = head + 1;
+    return true;
+  }
+
+  /**
+   * @brief Returns the number of events dropped because the queue was full.
+   *
+   */
+  uint16_t Overflows() const
+  {
+    uint16_t overflows;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      overflows = _overflows;
+    }
+    return overflows;
+  }
+};
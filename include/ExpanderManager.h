@@ -1,14 +1,9 @@
 #pragma once
 
 #include <Arduino.h>
-#include <Wire.h>
-#include <MCP23017.h>
 
-enum DetectionState
-{
-  WaitingForPress,
-  WaitingForRelease
-};
+#include "Debouncer.h"
+#include "I2CEngine.h"
 
 enum ButtonState
 {
@@ -19,24 +14,34 @@ enum ButtonState
 extern "C"
 {
   typedef void (*ExpanderEvent)(ButtonState, uint8_t, uint8_t);
+  typedef void (*ExpanderInterrupt)();
 };
 
 class ExpanderManager
 {
 private:
-  uint8_t _activeButton = 0;
   ExpanderEvent _buttonHandler;
-  DetectionState _currentState = DetectionState::WaitingForPress;
   uint8_t _deviceAddress;
-
-  MCP23017 *_mcp;
-
-  void CheckForButton();
-  void CheckForRelease();
-  static int GetBitPosition(uint16_t value);
+  ExpanderInterrupt _interruptHandler;
+  volatile bool _interruptPending = true;
+  uint8_t _intPin;
+  bool _polled = false;          // Read on a timer because _intPin can't raise an interrupt.
+  unsigned long _lastReadMs = 0; // When the last read was submitted.
+  uint16_t _previousStates = 0xFFFF;
+  Debouncer<uint16_t> _debouncer{0xFFFF};
+
+  // Background read of both GPIO ports.
+  I2CTransaction _read;
+  uint8_t _readBuffer[2];
+  bool _readInFlight = false;
+
+  static void OnReadComplete(I2CTransaction *transaction);
+  void ProcessButtonStates(uint16_t buttonStates);
+  void WriteRegisters(uint8_t reg, uint8_t portA, uint8_t portB);
 
 public:
-  ExpanderManager(uint8_t address, ExpanderEvent buttonHandler);
+  ExpanderManager(uint8_t address, uint8_t intPin, ExpanderInterrupt interruptHandler, ExpanderEvent buttonHandler);
+  void HandleInterrupt();
   void Init();
-  void Loop();
+  void Loop(unsigned long ms);
 };
\ No newline at end of file
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Maximum number of transactions waiting for or on the bus.
+static constexpr uint8_t I2C_QUEUE_LENGTH = 8;
+
+// Longest a transaction may stay on the bus before it's failed and the bus is reset.
+// The longest transfer the firmware makes is a 17 byte LED row write, which takes
+// about 0.5ms at 400kHz, so this leaves plenty of room for clock stretching.
+static constexpr uint32_t I2C_TIMEOUT_US = 10000;
+
+// Longest Start() waits for the previous stop to finish. A stop takes a few
+// microseconds unless a device is holding SCL low, and then I2C_TIMEOUT_US
+// catches the transaction that follows.
+static constexpr uint8_t I2C_STOP_TIMEOUT_US = 50;
+
+// Number of device addresses failed transactions are counted for. Failures on any
+// further addresses aren't counted.
+static constexpr uint8_t I2C_ERROR_SLOTS = 4;
+
+/**
+ * @brief Progress of an I2C transaction.
+ *
+ */
+enum class I2CStatus : uint8_t
+{
+  Idle,    //< Never submitted.
+  Pending, //< Queued or on the bus.
+  Done,    //< Completed successfully.
+  Failed,  //< The device didn't acknowledge, the bus arbitration was lost or it timed out.
+};
+
+struct I2CTransaction;
+
+extern "C"
+{
+  typedef void (*I2CCallback)(I2CTransaction *transaction);
+};
+
+/**
+ * @brief A register read or write on an I2C device. Transactions are owned by the
+ * code that submits them and, along with their buffers, must stay alive and unchanged
+ * until their status is no longer Pending.
+ *
+ */
+struct I2CTransaction
+{
+  uint8_t address;      //< 7-bit I2C address of the device.
+  uint8_t reg;          //< Register to start reading or writing at.
+  uint8_t *buffer;      //< Data to write, or where to put the data read.
+  uint8_t length;       //< Number of bytes to read or write.
+  bool read;            //< True to read from the device, false to write to it.
+  I2CCallback callback; //< Called from I2CEngine::Loop() once complete, may be nullptr.
+  void *context;        //< Passed along for the callback's use.
+  volatile I2CStatus status;
+};
+
+/////////////////////////////////////////////////////////////////////
+/// \class I2CEngine I2CEngine.h <I2CEngine.h>
+/// Runs I2C register reads and writes in the background from the TWI
+/// interrupt. Transactions are queued and go out on the bus in the
+/// order they were submitted, so the main loop carries on while they
+/// are transferred. Completion callbacks run from Loop() rather than
+/// the interrupt.
+class I2CEngine
+{
+private:
+  // Transactions waiting for or on the bus. The one at _active is on the bus
+  // whenever _busy is set.
+  I2CTransaction *volatile _queue[I2C_QUEUE_LENGTH];
+  volatile uint8_t _active = 0;
+  volatile uint8_t _count = 0;
+  volatile bool _busy = false;
+  volatile uint32_t _activeSince; // When the active transaction was started, from micros().
+
+  // Completed transactions with a callback waiting to run.
+  I2CTransaction *volatile _completed[I2C_QUEUE_LENGTH];
+  volatile uint8_t _completedHead = 0;
+  volatile uint8_t _completedCount = 0;
+
+  uint8_t _index;         // Next byte of the active transaction's buffer.
+  bool _registerSent;     // Whether the register address of the active transaction has gone out.
+
+  // Failed transactions per device address. A slot is free while its count is 0.
+  uint8_t _errorAddresses[I2C_ERROR_SLOTS];
+  volatile uint16_t _errorCounts[I2C_ERROR_SLOTS] = {};
+
+  void CheckTimeout();
+  void Complete(I2CStatus status);
+  void CountError(uint8_t address);
+  void Finish(I2CStatus status);
+  void Recover();
+  void Start();
+
+public:
+  void Begin(uint32_t frequency);
+  void HandleInterrupt();
+  void Loop();
+  bool Submit(I2CTransaction *transaction);
+  bool Transfer(I2CTransaction *transaction);
+  bool Read(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t length);
+  bool Write(uint8_t address, uint8_t reg, const uint8_t *buffer, uint8_t length);
+  uint8_t ErrorAddress(uint8_t slot);
+  uint16_t ErrorCount(uint8_t slot);
+};
+
+extern I2CEngine i2c;
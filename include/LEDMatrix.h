@@ -1,8 +1,33 @@
 #pragma once
+#include "I2CEngine.h"
 #include "is31fl3733.hpp"
 
 using namespace IS31FL3733;
 
+// Bytes per row of the LED on/off page, one bit per CS line.
+static constexpr uint8_t LED_STATE_BYTES_PER_ROW = CS_LINES / 8;
+
+// Maximum number of dirty framebuffer rows written to the driver per Loop().
+static constexpr uint8_t LED_ROWS_PER_LOOP = 2;
+
+// Length of brightness fades, including fading out for power save and back in.
+static constexpr uint16_t LED_FADE_LENGTH_MS = 300;
+
+// Minimum time between fade steps, which caps the I2C traffic a fade generates.
+static constexpr uint8_t LED_FADE_STEP_MS = 10;
+
+/**
+ * @brief Register pages on the IS31FL3733.
+ *
+ */
+enum LEDPage : uint8_t
+{
+  LEDOnOffPage = 0, //< One bit per LED turning it on or off.
+  LEDPWMPage = 1,   //< One byte per LED with its PWM duty cycle.
+  LEDABMPage = 2,   //< One byte per LED with its PWM or ABM mode.
+  LEDFunctionPage = 3,
+};
+
 extern "C"
 {
   typedef void (*LEDEvent)();
@@ -15,12 +40,10 @@ extern "C"
 enum LedState
 {
   ABMNotStarted,    //< Before ABM starts running.
+  WaitingForSeed,   //< Waiting for the random seed used to pick ABM patterns.
   ABMRunning,       //< While ABM is running.
   ABMComplete,      //< After the ABM complete interrupt fires.
   LEDOn,            //< ABM is complete and LEDs are on.
-  LEDOff,           //< ABM is complete and LEDs are off.
-  TurnOnPowerSave,  //< Before power save is turned on.
-  TurnOffPowerSave, //< Before power save is turned off.
 };
 
 class LEDMatrix
@@ -28,16 +51,57 @@ class LEDMatrix
 private:
   IS31FL3733::IS31FL3733Driver *_driver;
   LEDEvent _eventHandler;
+  uint8_t _i2cAddress;
   uint8_t _intbPin;
   volatile LedState _ledState = LedState::ABMNotStarted;
+  bool _powerSave = false;
   uint8_t _sdbPin;
 
+  // Brightness fade state. Levels are linear and go through the gamma table on the
+  // way to the PWM page.
+  uint8_t _brightness = 255; // Brightness to show when not in power save.
+  uint8_t _level = 0;        // Level currently in the framebuffer.
+  uint8_t _fadeFrom = 0;
+  uint8_t _fadeTo = 0;
+  uint32_t _fadeStart = 0;
+  bool _fadeStartPending = false; // Set when a fade starts, cleared once _fadeStart holds the next pass time.
+  uint32_t _lastFadeStep = 0;
+
+  // RAM copies of the PWM and on/off pages, with one dirty bit per row (SW line)
+  // for rows that still have to be written to the driver.
+  uint8_t _pwm[SW_LINES][CS_LINES] = {};
+  uint8_t _states[SW_LINES][LED_STATE_BYTES_PER_ROW] = {};
+  uint16_t _pwmDirtyRows = 0;
+  uint16_t _stateDirtyRows = 0;
+
+  // Background writes for a framebuffer flush: the page select followed by up to
+  // LED_ROWS_PER_LOOP rows.
+  uint8_t _page;
+  I2CTransaction _pageUnlock{};
+  I2CTransaction _pageSelect{};
+  I2CTransaction _rowWrites[LED_ROWS_PER_LOOP]{};
+
+  void ApplyLevel(uint8_t level);
+  void FlushRows();
+  bool IsFlushPending();
+  bool SubmitPageSelect(LEDPage page);
+  bool SubmitWrite(I2CTransaction &transaction, uint8_t reg, uint8_t *buffer, uint8_t length);
+  void StartABM();
+  void StartFade(uint8_t level);
+  void StepFade(uint32_t currentMs);
+  void WriteDirtyRows();
+  void WriteLEDModes(bool randomABM);
+  bool WritePageSelect(LEDPage page);
+
 public:
   LEDMatrix(ADDR addr1, ADDR addr2, uint8_t sdbPin, uint8_t intbPin, LEDEvent eventHandler);
 
   void HandleInterrupt();
   void Init();
-  void Loop();
+  void Loop(uint32_t currentMs);
   void SetBrightness(uint8_t brightness);
+  void SetLEDPWM(uint8_t cs, uint8_t sw, uint8_t value);
+  void SetLEDState(uint8_t cs, uint8_t sw, bool state);
   void SetPowerSaveMode(bool state);
+  void Start();
 };
\ No newline at end of file
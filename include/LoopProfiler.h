@@ -0,0 +1,110 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Number of histogram buckets per stage. Bucket 0 counts stages that took 0us, bucket n
+// counts stages that took 2^(n-1)us up to 2^n us, and the last bucket counts everything
+// from 2^(LOOP_PROFILE_BUCKETS - 2)us (16ms) up.
+static constexpr uint8_t LOOP_PROFILE_BUCKETS = 16;
+
+/**
+ * @brief Times the stages of each main loop pass with micros() and keeps a log2
+ * histogram of the durations for each stage, along with the longest one seen. Every
+ * stage takes LOOP_PROFILE_BUCKETS * 2 + 4 bytes of RAM. Counts stop at 65535 rather
+ * than wrapping.
+ *
+ * @tparam Stages Number of stages being timed.
+ */
+template <uint8_t Stages>
+class LoopProfiler
+{
+private:
+  uint16_t _counts[Stages][LOOP_PROFILE_BUCKETS] = {};
+  uint32_t _longest[Stages] = {};
+  uint32_t _passStart = 0;
+  uint32_t _stageStart = 0;
+
+  void Record(uint8_t stage, uint32_t duration)
+  {
+    if (duration > _longest[stage])
+    {
+      _longest[stage] = duration;
+    }
+
+    uint8_t bucket = 0;
+    while (duration && bucket < LOOP_PROFILE_BUCKETS - 1)
+    {
+      duration >>= 1;
+      bucket++;
+    }
+
+    if (_counts[stage][bucket] != UINT16_MAX)
+    {
+      _counts[stage][bucket]++;
+    }
+  }
+
+public:
+  /**
+   * @brief Marks the start of a main loop pass, and of its first stage.
+   *
+   */
+  void StartPass()
+  {
+    _passStart = micros();
+    _stageStart = _passStart;
+  }
+
+  /**
+   * @brief Records the time since the previous stage ended, or the pass started, against a stage.
+   *
+   * @param stage The stage that just ended.
+   */
+  void EndStage(uint8_t stage)
+  {
+    auto now = micros();
+    Record(stage, now - _stageStart);
+    _stageStart = now;
+  }
+
+  /**
+   * @brief Records the time since the pass started against a stage.
+   *
+   * @param stage The stage that holds the length of the whole pass.
+   */
+  void EndPass(uint8_t stage)
+  {
+    Record(stage, micros() - _passStart);
+  }
+
+  /**
+   * @brief Returns the number of times a stage took as long as a histogram bucket covers.
+   *
+   * @param stage The stage.
+   * @param bucket The bucket.
+   */
+  uint16_t Count(uint8_t stage, uint8_t bucket) const
+  {
+    return _counts[stage][bucket];
+  }
+
+  /**
+   * @brief Returns the longest a stage has taken, in microseconds.
+   *
+   * @param stage The stage.
+   */
+  uint32_t Longest(uint8_t stage) const
+  {
+    return _longest[stage];
+  }
+
+  /**
+   * @brief Clears every histogram.
+   *
+   */
+  void Reset()
+  {
+    memset(_counts, 0, sizeof(_counts));
+    memset(_longest, 0, sizeof(_longest));
+  }
+};
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <Arduino.h>
 
+#include "PinSnapshot.h"
+
 extern "C"
 {
   typedef void (*ButtonEvent)(byte, uint8_t, const __FlashStringHelper *);
@@ -21,12 +23,13 @@ class MFButton
 public:
   MFButton(uint8_t pin = 1, const __FlashStringHelper * = nullptr);
   static void AttachHandler(ButtonEvent newHandler);
-  void Update();
+  void Update(uint8_t newState);
   void Trigger(uint8_t state);
   void TriggerOnPress();
   void TriggerOnRelease();
   const __FlashStringHelper *_name;
   uint8_t _pin;
+  PinLocation _location;
 
 private:
   static ButtonEvent _handler;
@@ -23,16 +23,23 @@
 #include <stdlib.h>
 #include <Arduino.h>
 
+#include "EncoderAcceleration.h"
+#include "PinSnapshot.h"
+
 extern "C"
 {
-  typedef void (*EncoderEvent)(uint8_t eventId, uint8_t pin, const __FlashStringHelper *name);
+  typedef void (*EncoderEvent)(uint8_t eventId, uint8_t pin, const __FlashStringHelper *name, uint8_t count);
 };
 
 // this prevents the internal position overflow.
 #define MF_ENC_MAX 8000
 
-// this defines the delta value limit for triggering onFast
-#define MF_ENC_FAST_LIMIT 50 // 50
+#ifdef MF_ENC_DELTA_MESSAGES
+// steps in the same direction within this window are reported as one event with a count.
+#ifndef MF_ENC_COALESCE_MS
+#define MF_ENC_COALESCE_MS 20
+#endif
+#endif
 
 enum
 {
@@ -60,30 +67,43 @@ typedef struct
 class MFEncoder
 {
 public:
-  MFEncoder(uint8_t pin1 = 0, uint8_t pin2 = 1, uint8_t TypeEncoder = 0, const __FlashStringHelper *name = nullptr);
+  MFEncoder(uint8_t pin1 = 0, uint8_t pin2 = 1, uint8_t TypeEncoder = 0, const __FlashStringHelper *name = nullptr,
+            const AccelerationStep *curve = DefaultAccelerationCurve);
   static void attachHandler(EncoderEvent newHandler);
-  void Update();
+  // enable pin change interrupts for whichever of the encoder pins support them.
+  void EnablePinChangeInterrupts();
+  // currentMs is the caller's millis(), taken once per pass of the main loop.
+  void Update(uint32_t currentMs);
   // call this function every some milliseconds or by using an interrupt for handling state changes of the rotary encoder.
-  void Tick(void);
+  // when called from the main loop interrupts must be disabled, and the snapshot captured with them disabled,
+  // since the pin change interrupt calls it too.
+  void Tick(const PinSnapshot &pins, uint32_t currentMs);
   // retrieve the current position
   int16_t GetPosition();
   // adjust the current position
   void SetPosition(int16_t newPosition);
 
 private:
+  void SendEvent(uint8_t eventId, uint8_t count);
+
   static EncoderEvent _handler;
   uint8_t _pin1;
   uint8_t _pin2;
+  PinLocation _location1;
+  PinLocation _location2;
   bool _initialized;
   const __FlashStringHelper *_name;
   int16_t _pos;
+#ifdef MF_ENC_DELTA_MESSAGES
+  uint8_t _pendingEventId;  // event waiting to be sent
+  uint8_t _pendingCount;    // number of steps in the pending event, 0 if there isn't one
+  uint32_t _pendingSince;   // time the first step of the pending event was detected
+#endif
   uint8_t _TypeEncoder;
-  uint8_t _detentCounter;
   encoderType _encoderType;
-  int8_t _oldState;
-  int16_t _position;          // Internal position (4 times _positionExt)
-  int16_t _positionExt;       // External position
-  uint32_t _positionTime;     // time last position change was detected
-  uint32_t _positionTimePrev; // time previous position change was detected
-  uint32_t _lastFastDec;
+  const AccelerationStep *_curve; // acceleration curve in PROGMEM
+  DetentVelocity _velocity;       // turn speed, updated by Tick()
+  volatile int8_t _oldState;
+  volatile int16_t _position;    // Internal position (quadrature transitions)
+  volatile int16_t _positionExt; // External position (detents)
 };
\ No newline at end of file
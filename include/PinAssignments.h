@@ -2,10 +2,26 @@
 
 #include <Arduino.h>
 
+#include "PinSnapshot.h"
+
 // Physical pins for the LED driver.
 static constexpr uint8_t LED_SDB_PIN = 6;  // Arduino pin connected to SDB on the LED driver.
 static constexpr uint8_t LED_INTB_PIN = 1; // Arduino pin connected to to INTB on the LED driver.
 
+// Physical pins connected to the interrupt outputs of the MCP23017 expanders. INTA and
+// INTB are mirrored on each expander so a single pin covers all 16 inputs. The INT
+// routing isn't documented anywhere in this repo, so no wiring is assumed: by default
+// both expanders are polled every button scan. Once the wiring is confirmed, define
+// MCP1_INT_PIN and MCP2_INT_PIN in build_flags. A pin that isn't an external interrupt
+// on the board being built for is polled as well.
+static constexpr uint8_t MCP_INT_PIN_NONE = 0xFF; // The expander's INT output isn't connected.
+#ifndef MCP1_INT_PIN
+#define MCP1_INT_PIN MCP_INT_PIN_NONE // Arduino pin connected to INTA/INTB on the first expander.
+#endif
+#ifndef MCP2_INT_PIN
+#define MCP2_INT_PIN MCP_INT_PIN_NONE // Arduino pin connected to INTA/INTB on the second expander.
+#endif
+
 // Virtual pins for one-off MobiFlight "modules". The virtual pins created
 // for the MCP expanders start at 100, so other random virtual pins work
 // their way down from there.
@@ -23,4 +39,11 @@ static constexpr uint8_t ENCODER_TYPE = 0;
 static constexpr uint8_t PIN_A = 8;
 static constexpr uint8_t PIN_A_PRIME = 9;
 static constexpr uint8_t PIN_B = 5;
-static constexpr uint8_t PIN_B_PRIME = 10;
\ No newline at end of file
+static constexpr uint8_t PIN_B_PRIME = 10;
+
+// The five-way button and encoder pins are read from a PinSnapshot, so they must all have a port mapping.
+static_assert(IsSnapshotPin(PIN_LEFT) && IsSnapshotPin(PIN_UP) && IsSnapshotPin(PIN_RIGHT) &&
+                  IsSnapshotPin(PIN_DOWN) && IsSnapshotPin(PIN_CTR),
+              "Five-way button pins must be mapped in PinSnapshot.h");
+static_assert(IsSnapshotPin(PIN_A) && IsSnapshotPin(PIN_A_PRIME) && IsSnapshotPin(PIN_B) && IsSnapshotPin(PIN_B_PRIME),
+              "Encoder pins must be mapped in PinSnapshot.h");
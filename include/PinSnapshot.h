@@ -0,0 +1,138 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Input ports that get captured by a PinSnapshot.
+enum InputPort : uint8_t
+{
+  INPUT_PORT_B,
+  INPUT_PORT_C,
+  INPUT_PORT_D,
+#if defined(__AVR_ATmega32U4__)
+  INPUT_PORT_E,
+  INPUT_PORT_F,
+#endif
+  INPUT_PORT_COUNT,
+};
+
+// Location of an Arduino pin as an input port and the bit mask for the pin on that port.
+struct PinLocation
+{
+  uint8_t port;
+  uint8_t mask;
+};
+
+// Arduino pin to port mapping, indexed by Arduino pin number. These match the
+// variant pin tables in the Arduino core for each board. The table is kept in
+// flash and read with pgm_read_byte() at run time.
+#if defined(__AVR_ATmega32U4__)
+static constexpr PinLocation PIN_LOCATIONS[] PROGMEM = {
+    {INPUT_PORT_D, _BV(2)}, // 0
+    {INPUT_PORT_D, _BV(3)}, // 1
+    {INPUT_PORT_D, _BV(1)}, // 2
+    {INPUT_PORT_D, _BV(0)}, // 3
+    {INPUT_PORT_D, _BV(4)}, // 4
+    {INPUT_PORT_C, _BV(6)}, // 5
+    {INPUT_PORT_D, _BV(7)}, // 6
+    {INPUT_PORT_E, _BV(6)}, // 7
+    {INPUT_PORT_B, _BV(4)}, // 8
+    {INPUT_PORT_B, _BV(5)}, // 9
+    {INPUT_PORT_B, _BV(6)}, // 10
+    {INPUT_PORT_B, _BV(7)}, // 11
+    {INPUT_PORT_D, _BV(6)}, // 12
+    {INPUT_PORT_C, _BV(7)}, // 13
+    {INPUT_PORT_B, _BV(3)}, // 14
+    {INPUT_PORT_B, _BV(1)}, // 15
+    {INPUT_PORT_B, _BV(2)}, // 16
+    {INPUT_PORT_B, _BV(0)}, // 17
+    {INPUT_PORT_F, _BV(7)}, // 18, A0
+    {INPUT_PORT_F, _BV(6)}, // 19, A1
+    {INPUT_PORT_F, _BV(5)}, // 20, A2
+    {INPUT_PORT_F, _BV(4)}, // 21, A3
+    {INPUT_PORT_F, _BV(1)}, // 22, A4
+    {INPUT_PORT_F, _BV(0)}, // 23, A5
+};
+#elif defined(__AVR_ATmega328P__)
+static constexpr PinLocation PIN_LOCATIONS[] PROGMEM = {
+    {INPUT_PORT_D, _BV(0)}, // 0
+    {INPUT_PORT_D, _BV(1)}, // 1
+    {INPUT_PORT_D, _BV(2)}, // 2
+    {INPUT_PORT_D, _BV(3)}, // 3
+    {INPUT_PORT_D, _BV(4)}, // 4
+    {INPUT_PORT_D, _BV(5)}, // 5
+    {INPUT_PORT_D, _BV(6)}, // 6
+    {INPUT_PORT_D, _BV(7)}, // 7
+    {INPUT_PORT_B, _BV(0)}, // 8
+    {INPUT_PORT_B, _BV(1)}, // 9
+    {INPUT_PORT_B, _BV(2)}, // 10
+    {INPUT_PORT_B, _BV(3)}, // 11
+    {INPUT_PORT_B, _BV(4)}, // 12
+    {INPUT_PORT_B, _BV(5)}, // 13
+    {INPUT_PORT_C, _BV(0)}, // 14, A0
+    {INPUT_PORT_C, _BV(1)}, // 15, A1
+    {INPUT_PORT_C, _BV(2)}, // 16, A2
+    {INPUT_PORT_C, _BV(3)}, // 17, A3
+    {INPUT_PORT_C, _BV(4)}, // 18, A4
+    {INPUT_PORT_C, _BV(5)}, // 19, A5
+};
+#else
+#error "PinSnapshot has no pin mapping for this board."
+#endif
+
+static constexpr uint8_t SNAPSHOT_PIN_COUNT = sizeof(PIN_LOCATIONS) / sizeof(PIN_LOCATIONS[0]);
+
+/**
+ * @brief Returns the port and bit mask for an Arduino pin, or a location with a
+ * mask of zero if the pin has no mapping.
+ *
+ * @param pin The Arduino pin number.
+ * @return PinLocation The location of the pin.
+ */
+inline PinLocation GetPinLocation(uint8_t pin)
+{
+  if (pin >= SNAPSHOT_PIN_COUNT)
+  {
+    return PinLocation{INPUT_PORT_B, 0};
+  }
+  return PinLocation{pgm_read_byte(&PIN_LOCATIONS[pin].port), pgm_read_byte(&PIN_LOCATIONS[pin].mask)};
+}
+
+/**
+ * @brief Checks whether an Arduino pin can be read from a PinSnapshot. Usable in
+ * static_assert, where the table is read by the compiler rather than from flash.
+ *
+ * @param pin The Arduino pin number.
+ * @return true if the pin has a mapping.
+ */
+constexpr bool IsSnapshotPin(uint8_t pin)
+{
+  return pin < SNAPSHOT_PIN_COUNT && PIN_LOCATIONS[pin].mask != 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+/// \class PinSnapshot PinSnapshot.h <PinSnapshot.h>
+/// Captures all the input ports at the same instant so every pin
+/// read during a scan sees the same sample, at the cost of a single
+/// register read per port instead of a digitalRead() per pin.
+class PinSnapshot
+{
+public:
+  void Capture()
+  {
+    _ports[INPUT_PORT_B] = PINB;
+    _ports[INPUT_PORT_C] = PINC;
+    _ports[INPUT_PORT_D] = PIND;
+#if defined(__AVR_ATmega32U4__)
+    _ports[INPUT_PORT_E] = PINE;
+    _ports[INPUT_PORT_F] = PINF;
+#endif
+  }
+
+  bool IsHigh(PinLocation location) const
+  {
+    return _ports[location.port] & location.mask;
+  }
+
+private:
+  uint8_t _ports[INPUT_PORT_COUNT];
+};
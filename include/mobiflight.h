@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ExpanderManager.h"
+#include "PinSnapshot.h"
 
 enum MFDevice
 {
@@ -12,16 +13,13 @@ enum MFDevice
 // This is the list of recognized commands. These can be commands that can either be sent or received.
 // In order to receive, attach a callback function to these events
 //
-// If you increase this list, make sure to check that the MAXCALLBACKS value
-// in CmdMessenger.h is set apropriately
+// If you increase this list, make sure to add the new commands to the
+// CommandCallbacks table in mobiflight.cpp
 enum MFMessage
 {
   kInitModule = 0, // 0
   kSetModule = 1,  // 1
   kSetPin = 2,     // 2
-#ifdef DEBUG
-  kGenerateConfig = 3, // 3
-#endif
   kStatus = 5,              // 5
   kEncoderChange = 6,       // 6
   kButtonChange = 7,        // 7
@@ -39,18 +37,85 @@ enum MFMessage
   kGenNewSerial = 20,       // 20
   kTrigger = 23,            // 23
   kResetBoard = 24,         // 24
+
+  // Commands specific to this panel. Stock MobiFlight already uses the IDs from 25
+  // up (kSetLcdDisplayI2C through kSetStepperSpeedAccel and beyond), so these start
+  // at 50 to keep clear of them and of commands it adds later. 50 is held back for
+  // setting several key LEDs at once, once the key to LED wiring is known.
+  kGetBootTimes = 51,       // 51
+  kBootTimes = 52,          // 52
+  kGetLoopTimes = 53,       // 53
+  kLoopTimes = 54,          // 54
+  kGetStats = 55,           // 55
+  kStats = 56,              // 56
+};
+
+// Points during startup that are timestamped for kGetBootTimes. Every setup() stage
+// is stamped when it finishes.
+enum BootStage
+{
+  kBootEEPROM,     // MFeeprom.init()
+  kBootI2C,        // i2c.Begin()
+  kBootSerial,     // Serial.begin() and the command callbacks
+  kBootDevices,    // Buttons and encoders
+  kBootExpanders,  // Both MCP23017s
+  kBootLEDMatrix,  // LEDMatrix::Init()
+  kBootFirstInfo,  // The first kGetInfo from MobiFlight
+  BOOT_STAGE_COUNT,
+};
+
+// Stages of a loop() pass timed with LOOP_PROFILING. Each one runs from the end of
+// the one before it that ran in the same pass.
+enum LoopStage
+{
+  kLoopPass,      // The whole pass
+  kLoopSerial,    // cmdMessenger.feedinSerialData()
+  kLoopI2C,       // i2c.Loop(), which includes handling expander reads
+  kLoopExpanders, // mcp1.Loop() and mcp2.Loop()
+  kLoopButtons,   // Capturing the pins, ticking the encoders and ReadButtons()
+  kLoopEncoders,  // ReadEncoders()
+  kLoopEvents,    // DrainEvents()
+  kLoopLEDs,      // CheckForPowerSave() and ledMatrix.Loop()
+  kLoopFlush,     // cmdMessenger.flushCommands()
+  LOOP_STAGE_COUNT,
+};
+
+// Where an InputEvent came from.
+enum InputSource : uint8_t
+{
+  kSourceExpander,  // A key on the MCP23017s. id is the key's button number across both of them, state a ButtonState.
+  kSourceButton,    // An MF-style button. id is its pin, state its event id.
+  kSourceEncoder,   // An MF-style encoder. id is the pin that fired, state its event id and count the steps.
+  kSourceLEDMatrix, // The LED driver's interrupt.
+};
+
+// An input change waiting in the event queue to be handled from the main loop.
+struct InputEvent
+{
+  unsigned long time; // millis() when the change was seen.
+  InputSource source;
+  uint8_t id;
+  uint8_t state;
+  uint8_t count;
 };
 
 void attachCommandCallbacks();
+void DrainEvents();
 void generateSerial(bool force);
 void HandlerOnButton(uint8_t eventId, uint8_t pin, const __FlashStringHelper *name);
-void HandlerOnEncoder(uint8_t eventId, uint8_t pin, const __FlashStringHelper *name);
+void HandlerOnEncoder(uint8_t eventId, uint8_t pin, const __FlashStringHelper *name, uint8_t count);
 void loadConfig();
+void MarkBootStage(BootStage stage);
 void OnActivateConfig();
 void OnButtonPress(ButtonState state, uint8_t deviceAddress, uint8_t button);
+void OnEncoderPinChange();
 void OnGenNewSerial();
+void OnGetBootTimes();
 void OnGetConfig();
+void SendButtonConfig(uint8_t pin, const __FlashStringHelper *name);
 void OnGetInfo();
+void OnGetLoopTimes();
+void OnGetStats();
 void OnLEDEvent();
 void OnMCP1Interrupt();
 void OnMCP2Interrupt();
@@ -60,11 +125,12 @@ void OnSetConfig();
 void OnSetName();
 void OnSetPin();
 void OnUnknownCommand();
+void PushEvent(InputSource source, uint8_t id, uint8_t state, uint8_t count = 1);
 void readConfig();
+void SendButtonEvent(const InputEvent &event);
+void SendEncoderEvent(const InputEvent &event);
+void SendExpanderEvent(const InputEvent &event);
 void SendOk();
 void SetPowerSavingMode(bool state);
-void updatePowerSaving();
-
-#ifdef DEBUG
-void OnGenerateConfig();
-#endif
\ No newline at end of file
+void TickEncoders(const PinSnapshot &pins, uint32_t currentMs);
+void updatePowerSaving();
\ No newline at end of file
@@ -70,13 +70,30 @@ void CmdMessenger::init(Stream &ccomms, const char fld_separator, const char cmd
   field_separator = fld_separator;
   command_separator = cmd_separator;
   escape_character = esc_character;
+  buffer_commands = false;
+  txBuffer.init(ccomms);
+  droppedCommands = 0;
+  commandsReceived = 0;
+  commandsSent = 0;
+  overflowResets = 0;
+  unknownCommands = 0;
+  streamIndex = 0;
+  streamLength = 0;
   bufferLength = MESSENGERBUFFERSIZE;
   bufferLastIndex = MESSENGERBUFFERSIZE - 1;
   reset();
 
   default_callback = NULL;
+#if MAXCALLBACKS > 0
   for (int i = 0; i < MAXCALLBACKS; i++)
     callbackList[i] = NULL;
+#endif
+  progmemCallbacks = NULL;
+  progmemCallbackCount = 0;
+
+  ack_callback = NULL;
+  for (int i = 0; i < MAXPENDINGACKS; i++)
+    pendingAcks[i].active = false;
 
   pauseProcessing = false;
 }
@@ -88,8 +105,10 @@ void CmdMessenger::reset()
 {
   bufferIndex = 0;
   current = NULL;
-  last = NULL;
   dumped = true;
+  argOffsets[0] = 0;
+  rxArgEscaped = 0;
+  rxArgCount = 1;
 }
 
 /**
@@ -100,6 +119,18 @@ void CmdMessenger::printLfCr(bool addNewLine)
   print_newlines = addNewLine;
 }
 
+/**
+ * Holds sent commands in the transmit buffer until flushCommands() is called, so
+ * several commands sent in one pass are handed to the stream together. When
+ * disabled each command is flushed by sendCmdEnd().
+ */
+void CmdMessenger::bufferCommands(bool enable)
+{
+  buffer_commands = enable;
+  if (!enable)
+    txBuffer.flushBuffer();
+}
+
 /**
  * Attaches an default function for commands that are not explicitly attached
  */
@@ -108,6 +139,7 @@ void CmdMessenger::attach(messengerCallbackFunction newFunction)
   default_callback = newFunction;
 }
 
+#if MAXCALLBACKS > 0
 /**
  * Attaches a function to a command ID
  */
@@ -116,6 +148,25 @@ void CmdMessenger::attach(byte msgId, messengerCallbackFunction newFunction)
   if (msgId >= 0 && msgId < MAXCALLBACKS)
     callbackList[msgId] = newFunction;
 }
+#endif
+
+/**
+ * Attaches a table of functions indexed by command ID. The table must be stored in
+ * PROGMEM and NULL entries fall through to attached functions or the default function
+ */
+void CmdMessenger::attach(const messengerCallbackFunction *callbacks, uint8_t count)
+{
+  progmemCallbacks = callbacks;
+  progmemCallbackCount = count;
+}
+
+/**
+ * Attaches a function that is called when a requested acknowledge arrives or times out
+ */
+void CmdMessenger::attachAck(messengerAckCallbackFunction newFunction)
+{
+  ack_callback = newFunction;
+}
 
 // **** Command processing ****
 
@@ -124,30 +175,43 @@ void CmdMessenger::attach(byte msgId, messengerCallbackFunction newFunction)
  */
 void CmdMessenger::feedinSerialData()
 {
-  while (!pauseProcessing && comms->available())
+  checkAckTimeouts();
+
+  // Each call handles at most MAXCOMMANDSPERFEED commands and MAXBYTESPERFEED bytes so
+  // a burst of incoming commands can't hold up the rest of the caller's loop. Whatever
+  // is left, including a partly received command, is picked up by the next call.
+  uint8_t commands = 0;
+  uint16_t bytes = 0;
+  while (!pauseProcessing && commands < MAXCOMMANDSPERFEED && bytes < MAXBYTESPERFEED)
   {
-    // The Stream class has a readBytes() function that reads many bytes at once. On Teensy 2.0 and 3.0, readBytes() is optimized.
-    // Benchmarks about the incredible difference it makes: http://www.pjrc.com/teensy/benchmark_usb_serial_receive.html
+    if (streamIndex == streamLength)
+    {
+      // The Stream class has a readBytes() function that reads many bytes at once. On Teensy 2.0 and 3.0, readBytes() is optimized.
+      // Benchmarks about the incredible difference it makes: http://www.pjrc.com/teensy/benchmark_usb_serial_receive.html
+      size_t bytesAvailable = min(comms->available(), MAXSTREAMBUFFERSIZE);
+      streamIndex = 0;
+      streamLength = comms->readBytes(streamBuffer, bytesAvailable);
+      if (streamLength == 0)
+        break;
+    }
 
-    size_t bytesAvailable = min(comms->available(), MAXSTREAMBUFFERSIZE);
-    comms->readBytes(streamBuffer, bytesAvailable);
+    // Process the next byte in the stream buffer, and dispatch its callback if it completes a command
+    int messageState = processLine(streamBuffer[streamIndex++]);
+    bytes++;
 
-    // Process the bytes in the stream buffer, and handles dispatches callbacks, if commands are received
-    for (size_t byteNo = 0; byteNo < bytesAvailable; byteNo++)
+    // If waiting for acknowledge command
+    if (messageState == kEndOfMessage)
     {
-      int messageState = processLine(streamBuffer[byteNo]);
-
-      // If waiting for acknowledge command
-      if (messageState == kEndOfMessage)
-      {
-        handleMessage();
-      }
+      handleMessage();
+      commands++;
     }
   }
 }
 
 /**
- * Processes bytes and determines message state
+ * Processes bytes and determines message state.
+ * Field boundaries are recorded as the bytes arrive so the argument table is
+ * complete by the time the command separator is received.
  */
 uint8_t CmdMessenger::processLine(char serialChar)
 {
@@ -162,15 +226,35 @@ uint8_t CmdMessenger::processLine(char serialChar)
       messageState = kEndOfMessage;
       current = commandBuffer;
       CmdlastChar = '\0';
+      argCount = rxArgCount;
+      argEscaped = rxArgEscaped;
     }
     reset();
   }
+  else if ((serialChar == field_separator) && !escaped && rxArgCount < MAXARGUMENTS)
+  {
+    // Terminate the current field in place and start the next one after it.
+    // Once the table is full the remaining separators stay in the last field.
+    commandBuffer[bufferIndex] = '\0';
+    bufferIndex++;
+    argOffsets[rxArgCount++] = bufferIndex;
+    if (bufferIndex >= bufferLastIndex)
+    {
+      overflowResets++;
+      reset();
+    }
+  }
   else
   {
+    if ((serialChar == escape_character) && !escaped)
+      rxArgEscaped |= (1 << (rxArgCount - 1));
     commandBuffer[bufferIndex] = serialChar;
     bufferIndex++;
     if (bufferIndex >= bufferLastIndex)
+    {
+      overflowResets++;
       reset();
+    }
   }
   return messageState;
 }
@@ -180,55 +264,85 @@ uint8_t CmdMessenger::processLine(char serialChar)
  */
 void CmdMessenger::handleMessage()
 {
+  commandsReceived++;
   lastCommandId = readInt16Arg();
+  // Acknowledges that are being waited on are consumed here rather than dispatched
+  if (ArgOk && matchPendingAck(lastCommandId))
+    return;
+  messengerCallbackFunction callback = NULL;
+  // if command is in the PROGMEM table, we will call it
+  if (ArgOk && lastCommandId < progmemCallbackCount)
+    callback = (messengerCallbackFunction)pgm_read_word(&progmemCallbacks[lastCommandId]);
+#if MAXCALLBACKS > 0
   // if command attached, we will call it
-  if (lastCommandId >= 0 && lastCommandId < MAXCALLBACKS && ArgOk && callbackList[lastCommandId] != NULL)
-    (*callbackList[lastCommandId])();
-  else // If command not attached, call default callback (if attached)
-      if (default_callback != NULL)
-    (*default_callback)();
+  if (callback == NULL && ArgOk && lastCommandId < MAXCALLBACKS)
+    callback = callbackList[lastCommandId];
+#endif
+  // If command not attached, call default callback (if attached)
+  if (callback == NULL)
+  {
+    unknownCommands++;
+    callback = default_callback;
+  }
+  if (callback != NULL)
+    (*callback)();
 }
 
 /**
- * Waits for reply from sender or timeout before continuing
+ * Starts waiting on an acknowledge. Returns false if all slots are in use
  */
-bool CmdMessenger::blockedTillReply(unsigned int timeout, byte ackCmdId)
+bool CmdMessenger::addPendingAck(byte ackCmdId, unsigned int timeout)
 {
-  unsigned long time = millis();
-  unsigned long start = time;
-  bool receivedAck = false;
-  while ((time - start) < timeout && !receivedAck)
+  for (int i = 0; i < MAXPENDINGACKS; i++)
   {
-    time = millis();
-    receivedAck = checkForAck(ackCmdId);
+    if (!pendingAcks[i].active)
+    {
+      pendingAcks[i].active = true;
+      pendingAcks[i].ackCmdId = ackCmdId;
+      pendingAcks[i].timeout = timeout;
+      pendingAcks[i].sentAt = millis();
+      return true;
+    }
   }
-  return receivedAck;
+  return false;
 }
 
 /**
- *   Loops as long data is available to determine if acknowledge has come in
+ * Completes the oldest acknowledge waiting on the command ID. Returns true if one was found
  */
-bool CmdMessenger::checkForAck(byte ackCommand)
+bool CmdMessenger::matchPendingAck(byte ackCmdId)
 {
-  while (comms->available())
+  int match = -1;
+  for (int i = 0; i < MAXPENDINGACKS; i++)
   {
-    //Processes a byte and determines if an acknowlegde has come in
-    int messageState = processLine(comms->read());
-    if (messageState == kEndOfMessage)
+    if (pendingAcks[i].active && pendingAcks[i].ackCmdId == ackCmdId &&
+        (match < 0 || (long)(pendingAcks[i].sentAt - pendingAcks[match].sentAt) < 0))
+      match = i;
+  }
+  if (match < 0)
+    return false;
+
+  pendingAcks[match].active = false;
+  if (ack_callback != NULL)
+    (*ack_callback)(ackCmdId, true);
+  return true;
+}
+
+/**
+ * Expires acknowledges that were not answered in time
+ */
+void CmdMessenger::checkAckTimeouts()
+{
+  unsigned long time = millis();
+  for (int i = 0; i < MAXPENDINGACKS; i++)
+  {
+    if (pendingAcks[i].active && (time - pendingAcks[i].sentAt) >= pendingAcks[i].timeout)
     {
-      int id = readInt16Arg();
-      if (ackCommand == id && ArgOk)
-      {
-        return true;
-      }
-      else
-      {
-        return false;
-      }
+      pendingAcks[i].active = false;
+      if (ack_callback != NULL)
+        (*ack_callback)(pendingAcks[i].ackCmdId, false);
     }
-    return false;
   }
-  return false;
 }
 
 /**
@@ -236,18 +350,30 @@ bool CmdMessenger::checkForAck(byte ackCommand)
  */
 bool CmdMessenger::next()
 {
-  char *temppointer = NULL;
   // Currently, cmd messenger only supports 1 char for the field seperator
   switch (messageState)
   {
   case kProccesingMessage:
     return false;
   case kEndOfMessage:
-    temppointer = commandBuffer;
+    argIndex = 0;
     messageState = kProcessingArguments;
   default:
     if (dumped)
-      current = split_r(temppointer, field_separator, &last);
+    {
+      // Empty fields are skipped, the same as consecutive delimiters were
+      // when the arguments were tokenized on demand.
+      current = NULL;
+      while (argIndex < argCount && current == NULL)
+      {
+        if (commandBuffer[argOffsets[argIndex]] != '\0')
+        {
+          current = &commandBuffer[argOffsets[argIndex]];
+          currentEscaped = argEscaped & (1 << argIndex);
+        }
+        argIndex++;
+      }
+    }
     if (current != NULL)
     {
       dumped = true;
@@ -292,7 +418,7 @@ void CmdMessenger::sendCmdStart(byte cmdId)
   {
     startCommand = true;
     pauseProcessing = true;
-    comms->print(cmdId);
+    txBuffer.print(cmdId);
   }
 }
 
@@ -303,7 +429,7 @@ void CmdMessenger::sendCmdEscArg(char *arg)
 {
   if (startCommand)
   {
-    comms->print(field_separator);
+    txBuffer.print(field_separator);
     printEsc(arg);
   }
 }
@@ -323,8 +449,8 @@ void CmdMessenger::sendCmdfArg(char *fmt, ...)
     vsnprintf(msg, maxMessageSize, fmt, args);
     va_end(args);
 
-    comms->print(field_separator);
-    comms->print(msg);
+    txBuffer.print(field_separator);
+    txBuffer.print(msg);
   }
 }
 
@@ -336,7 +462,7 @@ void CmdMessenger::sendCmdSciArg(double arg, unsigned int n)
 {
   if (startCommand)
   {
-    comms->print(field_separator);
+    txBuffer.print(field_separator);
     printSci(arg, n);
   }
 }
@@ -354,24 +480,97 @@ void CmdMessenger::sendSciArg(double arg, unsigned int n)
 }
 
 /**
- * Send end of command
+ * Send end of command.
+ * If an acknowledge is requested this doesn't wait for it. The acknowledge is
+ * matched as data is fed in and the ack callback is called when it arrives or
+ * times out. Returns true if the acknowledge is being waited on.
  */
 bool CmdMessenger::sendCmdEnd(bool reqAc, byte ackCmdId, unsigned int timeout)
 {
-  bool ackReply = false;
+  bool ackPending = false;
   if (startCommand)
   {
-    comms->print(command_separator);
+    commandsSent++;
+    txBuffer.print(command_separator);
     if (print_newlines)
-      comms->println(); // should append BOTH \r\n
+      txBuffer.println(); // should append BOTH \r\n
+    if (!buffer_commands || reqAc)
+      txBuffer.flushBuffer();
     if (reqAc)
     {
-      ackReply = blockedTillReply(timeout, ackCmdId);
+      ackPending = addPendingAck(ackCmdId, timeout);
     }
   }
   pauseProcessing = false;
   startCommand = false;
-  return ackReply;
+  return ackPending;
+}
+
+/**
+ * Sends as much of the commands held in the transmit buffer as the stream can take
+ * without blocking. Anything left over is sent by the next call.
+ */
+void CmdMessenger::flushCommands()
+{
+  txBuffer.flushAvailable();
+}
+
+/**
+ * Returns true if the stream couldn't take all the held commands at the last flush
+ */
+bool CmdMessenger::isTxBacklogged()
+{
+  return txBuffer.isBacklogged();
+}
+
+/**
+ * Returns the total time, in microseconds, spent waiting on the stream because the
+ * transmit buffer was full
+ */
+unsigned long CmdMessenger::getTxBlockedMicros()
+{
+  return txBuffer.getBlockedMicros();
+}
+
+/**
+ * Returns the number of low priority commands dropped because the stream was backlogged
+ */
+uint16_t CmdMessenger::getDroppedCommands()
+{
+  return droppedCommands;
+}
+
+/**
+ * Returns the number of commands received, including acknowledges and unknown commands
+ */
+uint32_t CmdMessenger::getCommandsReceived()
+{
+  return commandsReceived;
+}
+
+/**
+ * Returns the number of commands sent
+ */
+uint32_t CmdMessenger::getCommandsSent()
+{
+  return commandsSent;
+}
+
+/**
+ * Returns the number of received commands thrown away part way through because
+ * they were too long for the command buffer
+ */
+uint16_t CmdMessenger::getOverflowResets()
+{
+  return overflowResets;
+}
+
+/**
+ * Returns the number of received commands that had no callback attached
+ */
+uint16_t CmdMessenger::getUnknownCommands()
+{
+  return unknownCommands;
 }
 
 /**
@@ -402,36 +601,6 @@ bool CmdMessenger::sendCmd(byte cmdId)
 
 // **** Command receiving ****
 
-/**
- * Find next argument in command
- */
-int CmdMessenger::findNext(char *str, char delim)
-{
-  int pos = 0;
-  bool escaped = false;
-  bool EOL = false;
-  ArglastChar = '\0';
-  while (true)
-  {
-    escaped = isEscaped(str, escape_character, &ArglastChar);
-    EOL = (*str == '\0' && !escaped);
-    if (EOL)
-    {
-      return pos;
-    }
-    if (*str == field_separator && !escaped)
-    {
-      return pos;
-    }
-    else
-    {
-      str++;
-      pos++;
-    }
-  }
-  return pos;
-}
-
 /**
  * Read the next argument as int
  */
@@ -599,43 +768,6 @@ void CmdMessenger::unescape(char *fromChar)
   }
 }
 
-/**
- * Split string in different tokens, based on delimiter
- * Note that this is basically strtok_r, but with support for an escape character
- */
-char *CmdMessenger::split_r(char *str, const char delim, char **nextp)
-{
-  char *ret;
-  // if input null, this is not the first call, use the nextp pointer instead
-  if (str == NULL)
-  {
-    str = *nextp;
-  }
-  // Strip leading delimiters
-  while (findNext(str, delim) == 0 && *str)
-  {
-    str++;
-  }
-  // If this is a \0 char, return null
-  if (*str == '\0')
-  {
-    return NULL;
-  }
-  // Set start of return pointer to this position
-  ret = str;
-  // Find next delimiter
-  str += findNext(str, delim);
-  // and exchange this for a a \0 char. This will terminate the char
-  if (*str)
-  {
-    *str++ = '\0';
-  }
-  // Set the next pointer to this char
-  *nextp = str;
-  // return current pointer
-  return ret;
-}
-
 /**
  * Indicates if the current character is escaped
  */
@@ -671,9 +803,9 @@ void CmdMessenger::printEsc(char str)
 {
   if (str == field_separator || str == command_separator || str == escape_character || str == '\0')
   {
-    comms->print(escape_character);
+    txBuffer.print(escape_character);
   }
-  comms->print(str);
+  txBuffer.print(str);
 }
 
 /**
@@ -684,20 +816,20 @@ void CmdMessenger::printSci(double f, unsigned int digits)
   // handle sign
   if (f < 0.0)
   {
-    Serial.print('-');
+    txBuffer.print('-');
     f = -f;
   }
 
   // handle infinite values
   if (isinf(f))
   {
-    Serial.print("INF");
+    txBuffer.print("INF");
     return;
   }
   // handle Not a Number
   if (isnan(f))
   {
-    Serial.print("NaN");
+    txBuffer.print("NaN");
     return;
   }
 
@@ -734,5 +866,96 @@ void CmdMessenger::printSci(double f, unsigned int digits)
   sprintf(format, "%%ld.%%0%dldE%%+d", digits);
   char output[16];
   sprintf(output, format, whole, part, exponent);
-  comms->print(output);
-}
\ No newline at end of file
+  txBuffer.print(output);
+}
+
+// **** Transmit buffer ****
+
+/**
+ * Sets the stream the transmit buffer is flushed to
+ */
+void CmdTxBuffer::init(Stream &ccomms)
+{
+  comms = &ccomms;
+  length = 0;
+  backlogged = false;
+  blockedMicros = 0;
+}
+
+/**
+ * Hands all buffered bytes to the stream in a single write
+ */
+void CmdTxBuffer::flushBuffer()
+{
+  if (length > 0)
+  {
+    comms->write(buffer, length);
+    length = 0;
+  }
+}
+
+/**
+ * Hands the stream as many buffered bytes as it can take without blocking and
+ * keeps the rest, in order, for the next flush
+ */
+void CmdTxBuffer::flushAvailable()
+{
+  int space = comms->availableForWrite();
+  uint8_t count = length;
+  if (space < count)
+    count = space > 0 ? space : 0;
+
+  if (count > 0)
+  {
+    comms->write(buffer, count);
+    length -= count;
+    memmove(buffer, &buffer[count], length);
+  }
+  backlogged = length > 0;
+}
+
+/**
+ * Makes room in a full buffer. Whatever the stream can take right away is sent
+ * first, and only if that frees nothing does it wait for the stream, with the
+ * time spent waiting added to blockedMicros.
+ */
+void CmdTxBuffer::makeRoom()
+{
+  flushAvailable();
+  if (length < MAXTXBUFFERSIZE)
+    return;
+
+  unsigned long start = micros();
+  flushBuffer();
+  blockedMicros += micros() - start;
+}
+
+/**
+ * Adds a byte to the buffer, making room first if the buffer is full
+ */
+size_t CmdTxBuffer::write(uint8_t value)
+{
+  if (length >= MAXTXBUFFERSIZE)
+    makeRoom();
+  buffer[length++] = value;
+  return 1;
+}
+
+/**
+ * Adds a block of bytes to the buffer, making room as often as needed to fit them
+ */
+size_t CmdTxBuffer::write(const uint8_t *data, size_t size)
+{
+  size_t remaining = size;
+  while (remaining > 0)
+  {
+    if (length >= MAXTXBUFFERSIZE)
+      makeRoom();
+    uint8_t count = min(remaining, (size_t)(MAXTXBUFFERSIZE - length));
+    memcpy(&buffer[length], data, count);
+    length += count;
+    data += count;
+    remaining -= count;
+  }
+  return size;
+}
@@ -1,10 +1,22 @@
 #include <Arduino.h>
-#include <Wire.h>
-#include <MCP23017.h>
 
 #include "ExpanderManager.h"
+#include "I2CEngine.h"
 
 static constexpr unsigned long PRESS_AND_HOLD_LENGTH_MS = 500; // Length of time a key must be held for a long press.
+static constexpr unsigned long IDLE_POLL_INTERVAL_MS = 10;     // Time between reads of an idle expander without INT wiring.
+
+// MCP23017 register addresses, for the A port of each pair with IOCON.BANK = 0.
+static constexpr uint8_t IODIR_A = 0x00;
+static constexpr uint8_t GPINTEN_A = 0x04;
+static constexpr uint8_t INTCON_A = 0x08;
+static constexpr uint8_t IOCON = 0x0A;
+static constexpr uint8_t GPPU_A = 0x0C;
+static constexpr uint8_t GPIO_A = 0x12;
+
+// IOCON configuration bits.
+static constexpr uint8_t IOCON_MIRROR = 0b01000000; // INTA and INTB are internally connected.
+static constexpr uint8_t IOCON_SEQOP = 0b00100000;  // Address pointer toggles between A/B register pairs.
 
 #ifdef DEBUG
 // Helper function to write a 16 bit value out as bits for debugging purposes.
@@ -38,32 +50,31 @@ void write8AsBits(uint8_t value)
 }
 #endif
 
-ExpanderManager::ExpanderManager(uint8_t address, ExpanderEvent buttonHandler)
+/**
+ * @brief Construct a new ExpanderManager object
+ *
+ * @param address I2C address of the MCP23017.
+ * @param intPin Arduino pin connected to INTA/INTB on the MCP23017. If it isn't an
+ * external interrupt pin the expander is polled every IDLE_POLL_INTERVAL_MS instead.
+ * @param interruptHandler Function attached to the interrupt on intPin.
+ * @param buttonHandler Function called when a button is pressed or released.
+ */
+ExpanderManager::ExpanderManager(uint8_t address, uint8_t intPin, ExpanderInterrupt interruptHandler, ExpanderEvent buttonHandler)
 {
-  _mcp = new MCP23017(address);
   _deviceAddress = address;
+  _intPin = intPin;
+  _interruptHandler = interruptHandler;
   _buttonHandler = buttonHandler;
+  _read = {address, GPIO_A, _readBuffer, sizeof(_readBuffer), true, OnReadComplete, this, I2CStatus::Idle};
 }
 
 /**
- * @brief Get the bit position for a single low bit in a byte.
+ * @brief Flags that the MCP23017 reported a change on its inputs.
  *
- * @param value The byte to check, with the active bit set to low and inactive bits set high
- * @return int The position of the single low bit in the byte
  */
-int ExpanderManager::GetBitPosition(uint16_t value)
+void ExpanderManager::HandleInterrupt()
 {
-  // The entire key detection logic uses low for active so invert the bits
-  // to ensure this magic works properly.
-  value = ~value;
-  // value is a power of two, returned values are {0, 1, ..., 15}
-  // This is effectively calculating log2(n) since it's guaranteed there will only ever
-  // be one bit set in the value. It's a variation of the method shown
-  // at http://graphics.stanford.edu/~seander/bithacks.html#IntegerLog.
-  return (((value & 0xAAAAAAAA) != 0) |
-          (((value & 0xCCCCCCCC) != 0) << 1) |
-          (((value & 0xF0F0F0F0) != 0) << 2) |
-          (((value & 0xFF00FF00) != 0) << 3));
+  _interruptPending = true;
 }
 
 /**
@@ -72,81 +83,131 @@ int ExpanderManager::GetBitPosition(uint16_t value)
  */
 void ExpanderManager::Init()
 {
-  _mcp->init();
-
-  _mcp->writeRegister(MCP23017Register::IODIR_A, 0xFF, 0xFF); // All as input.
-  _mcp->writeRegister(MCP23017Register::GPIO_A, 0xFF, 0xFF);  // Reset all to 1s.
-  _mcp->writeRegister(MCP23017Register::GPPU_A, 0xFF, 0xFF);  // Turn on pull up resistors.
+  // Raise an interrupt whenever any input changes from its previous value, with
+  // INTA and INTB mirrored so one Arduino pin covers both ports. With SEQOP set the
+  // address pointer toggles between the A and B register of a pair, so each pair is
+  // written and read in a single transaction.
+  uint8_t iocon = IOCON_MIRROR | IOCON_SEQOP;
+  i2c.Write(_deviceAddress, IOCON, &iocon, 1);
+
+  WriteRegisters(IODIR_A, 0xFF, 0xFF);   // All as input.
+  WriteRegisters(GPIO_A, 0xFF, 0xFF);    // Reset all to 1s.
+  WriteRegisters(GPPU_A, 0xFF, 0xFF);    // Turn on pull up resistors.
+  WriteRegisters(INTCON_A, 0x00, 0x00);  // Compare against the previous value.
+  WriteRegisters(GPINTEN_A, 0xFF, 0xFF); // Enable interrupt on change for all pins.
+
+  _previousStates = 0xFFFF;
+  _debouncer.Reset(0xFFFF);
+
+  // Register for interrupts when an input changes. The first pass through Loop()
+  // reads the ports, which also clears anything that fired before this point.
+  // Without an interrupt on the pin the inputs are polled on a timer instead.
+  _polled = digitalPinToInterrupt(_intPin) == NOT_AN_INTERRUPT;
+  if (!_polled)
+  {
+    pinMode(_intPin, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(_intPin), _interruptHandler, FALLING);
+  }
+  _interruptPending = true;
+}
 
-  _currentState = DetectionState::WaitingForPress;
+/**
+ * @brief Writes the A and B registers of a register pair.
+ *
+ * @param reg The A register of the pair.
+ * @param portA Value for the A register.
+ * @param portB Value for the B register.
+ */
+void ExpanderManager::WriteRegisters(uint8_t reg, uint8_t portA, uint8_t portB)
+{
+  uint8_t values[] = {portA, portB};
+  i2c.Write(_deviceAddress, reg, values, sizeof(values));
 }
 
 /**
- * @brief Determines which button is currently pressed.
+ * @brief Compares a snapshot of the inputs with the previous one and reports a
+ * press or release for every input that changed. Each input is handled on its own
+ * so any number of buttons can be held down at the same time.
  *
+ * @param buttonStates The state of all 16 inputs, with pressed buttons low.
  */
-void ExpanderManager::CheckForButton()
+void ExpanderManager::ProcessButtonStates(uint16_t buttonStates)
 {
-  auto buttonStates = _mcp->read();
+  uint16_t changed = buttonStates ^ _previousStates;
+  _previousStates = buttonStates;
 
-  // If nothing is pressed then just return
-  if (buttonStates == 0xFFFF)
+  for (uint8_t button = 0; changed != 0; button++, changed >>= 1, buttonStates >>= 1)
   {
-    return;
-  }
+    if (!(changed & 1))
+    {
+      continue;
+    }
 
-  // Figure out which button is actually pressed. This assumes only one button
-  // will ever be pressed at a given time.
-  _activeButton = ExpanderManager::GetBitPosition(buttonStates);
+    auto state = (buttonStates & 1) ? ButtonState::Released : ButtonState::Pressed;
 
 #ifdef DEBUG
-  Serial.print("Detected press at: ");
-  Serial.print(_activeButton);
-  Serial.print(" on expander: ");
-  Serial.print(_deviceAddress);
-  Serial.println();
+    Serial.print(state == ButtonState::Pressed ? "Detected press at: " : "Detected release at: ");
+    Serial.print(button);
+    Serial.print(" on expander: ");
+    Serial.print(_deviceAddress);
+    Serial.println();
 #endif
 
-  _buttonHandler(ButtonState::Pressed, _deviceAddress, _activeButton);
-
-  _currentState = WaitingForRelease;
+    _buttonHandler(state, _deviceAddress, button);
+  }
 }
 
 /**
- * @brief Determines when a button was released.
+ * @brief Handles the result of a background read of the GPIO ports.
  *
+ * @param transaction The completed read.
  */
-void ExpanderManager::CheckForRelease()
+void ExpanderManager::OnReadComplete(I2CTransaction *transaction)
 {
-  auto buttonStates = _mcp->read();
+  auto expander = static_cast<ExpanderManager *>(transaction->context);
+  expander->_readInFlight = false;
 
-  // If all the inputs are back to 1s then the button was released.
-  if (buttonStates == 0xFFFF)
+  if (transaction->status != I2CStatus::Done)
   {
-#ifdef DEBUG
-    Serial.print("Detected release at: ");
-    Serial.print(_activeButton);
-    Serial.print(" on expander: ");
-    Serial.print(_deviceAddress);
-    Serial.println();
-#endif
-
-    _buttonHandler(ButtonState::Released, _deviceAddress, _activeButton);
-
-    _currentState = WaitingForPress;
+    // Try again on the next scan.
+    expander->_interruptPending = true;
+    return;
   }
+
+  uint16_t buttonStates = expander->_readBuffer[0] | (expander->_readBuffer[1] << 8);
+  expander->ProcessButtonStates(expander->_debouncer.Update(buttonStates));
 }
 
-void ExpanderManager::Loop()
+/**
+ * @brief Starts a read of the inputs if there may be something new to see.
+ *
+ * @param ms The current time in milliseconds.
+ */
+void ExpanderManager::Loop(unsigned long ms)
 {
-  // Fininte state machine for button detection.
-  switch (_currentState)
+  // The previous read is still on the bus or waiting for its callback.
+  if (_readInFlight)
+  {
+    return;
+  }
+
+  // If the expander hasn't reported a change and the debouncer has nothing left
+  // to settle there's nothing new to read, so the bus stays idle. Without INT
+  // wiring a change can't be reported, so an idle expander is still read every
+  // IDLE_POLL_INTERVAL_MS to look for one.
+  if (!_interruptPending && _debouncer.IsSettled() && (!_polled || ms - _lastReadMs < IDLE_POLL_INTERVAL_MS))
+  {
+    return;
+  }
+
+  // Reading GPIO clears the interrupt. The inputs keep being sampled every scan
+  // until they've been stable long enough for the debouncer to settle. A press
+  // shorter than that is bounce, so the INTCAP snapshot isn't needed to catch it.
+  // The read runs in the background and is handled by OnReadComplete().
+  if (i2c.Submit(&_read))
   {
-  case WaitingForPress:
-    CheckForButton();
-    break;
-  case WaitingForRelease:
-    CheckForRelease();
-    break;
+    _interruptPending = false;
+    _readInFlight = true;
+    _lastReadMs = ms;
   }
 }
@@ -0,0 +1,410 @@
+#include <Arduino.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/twi.h>
+
+#include "I2CEngine.h"
+
+I2CEngine i2c;
+
+// TWCR values for each step of a transaction. The interrupt stays enabled until the
+// last transaction in the queue is done.
+static constexpr uint8_t TWCR_START = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);   // Send a (repeated) start.
+static constexpr uint8_t TWCR_NEXT = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);                 // Send a byte, or receive one and NACK it.
+static constexpr uint8_t TWCR_NEXT_ACK = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA); // Receive a byte and ACK it.
+static constexpr uint8_t TWCR_STOP = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);                // Send a stop and go idle.
+static constexpr uint8_t TWCR_STOP_START = TWCR_STOP | _BV(TWSTA) | _BV(TWIE);            // Send a stop followed by a start.
+
+ISR(TWI_vect)
+{
+  i2c.HandleInterrupt();
+}
+
+/**
+ * @brief Sets up the TWI hardware.
+ *
+ * @param frequency The I2C clock frequency in Hz.
+ */
+void I2CEngine::Begin(uint32_t frequency)
+{
+  // Turn on the internal pull ups, the same as Wire does.
+  pinMode(SDA, INPUT_PULLUP);
+  pinMode(SCL, INPUT_PULLUP);
+
+  TWSR = 0; // Prescaler of 1.
+  TWBR = ((F_CPU / frequency) - 16) / 2;
+  TWCR = _BV(TWEN);
+}
+
+/**
+ * @brief Queues a transaction to run in the background. The transaction's status
+ * changes from Pending to Done or Failed once it's complete, and its callback runs
+ * from the next call to Loop() after that.
+ *
+ * @param transaction The transaction to run. Reads must be at least one byte long.
+ * @return true if the transaction was queued, false if the queue is full.
+ */
+bool I2CEngine::Submit(I2CTransaction *transaction)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    // Transactions with a callback also need room to wait for Loop() once they're
+    // complete. Those without one only need room on the queue, so Transfer() can
+    // always make progress even if Loop() isn't being called.
+    auto used = _count + (transaction->callback ? _completedCount : 0);
+    if (used >= I2C_QUEUE_LENGTH)
+    {
+      return false;
+    }
+
+    transaction->status = I2CStatus::Pending;
+    _queue[(_active + _count) % I2C_QUEUE_LENGTH] = transaction;
+    _count++;
+
+    if (!_busy)
+    {
+      Start();
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Runs a transaction and waits for it to complete. Must not be called with
+ * interrupts disabled. A transaction that's stuck on the bus is failed after
+ * I2C_TIMEOUT_US, so this always returns.
+ *
+ * @param transaction The transaction to run.
+ * @return true if the transaction succeeded.
+ */
+bool I2CEngine::Transfer(I2CTransaction *transaction)
+{
+  while (!Submit(transaction))
+  {
+    CheckTimeout(); // wait here for room on the queue
+  }
+
+  while (transaction->status == I2CStatus::Pending)
+  {
+    CheckTimeout(); // wait here for the transaction to complete
+  }
+
+  return transaction->status == I2CStatus::Done;
+}
+
+/**
+ * @brief Reads a buffer of data from consecutive registers and waits for it to arrive.
+ *
+ * @param address I2C address of the device to read the data from.
+ * @param reg Address of the register to start reading at.
+ * @param buffer Buffer to read the data into.
+ * @param length Number of bytes to read.
+ * @return true if the read succeeded.
+ */
+bool I2CEngine::Read(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t length)
+{
+  I2CTransaction transaction{address, reg, buffer, length, true, nullptr, nullptr, I2CStatus::Idle};
+  return Transfer(&transaction);
+}
+
+/**
+ * @brief Writes a buffer of data to consecutive registers and waits for it to go out.
+ *
+ * @param address I2C address of the device to write the data to.
+ * @param reg Address of the register to start writing at.
+ * @param buffer Data to write.
+ * @param length Number of bytes to write.
+ * @return true if the write succeeded.
+ */
+bool I2CEngine::Write(uint8_t address, uint8_t reg, const uint8_t *buffer, uint8_t length)
+{
+  I2CTransaction transaction{address, reg, const_cast<uint8_t *>(buffer), length, false, nullptr, nullptr, I2CStatus::Idle};
+  return Transfer(&transaction);
+}
+
+/**
+ * @brief Runs the callbacks of completed transactions and resets the bus if the
+ * active transaction is stuck. Call this from the main loop.
+ *
+ */
+void I2CEngine::Loop()
+{
+  CheckTimeout();
+
+  // At most one queue's worth of callbacks run per call, so callbacks that submit
+  // more transactions can't keep Loop() from returning.
+  for (auto i = 0; i < I2C_QUEUE_LENGTH; i++)
+  {
+    I2CTransaction *transaction = nullptr;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      if (_completedCount)
+      {
+        transaction = _completed[_completedHead];
+        _completedHead = (_completedHead + 1) % I2C_QUEUE_LENGTH;
+        _completedCount--;
+      }
+    }
+
+    if (transaction == nullptr)
+    {
+      return;
+    }
+
+    transaction->callback(transaction);
+  }
+}
+
+/**
+ * @brief Fails the active transaction and resets the bus if it's been on the bus for
+ * longer than I2C_TIMEOUT_US.
+ *
+ */
+void I2CEngine::CheckTimeout()
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if (_busy && micros() - _activeSince >= I2C_TIMEOUT_US)
+    {
+      Recover();
+    }
+  }
+}
+
+/**
+ * @brief Fails the active transaction and frees the bus from a device that's still
+ * driving it. The TWI hardware is turned off while SCL is clocked by hand, up to nine
+ * times, until the device lets go of SDA. A stop then leaves every device idle, and
+ * the next transaction in the queue is started. Must be called with interrupts disabled.
+ *
+ */
+void I2CEngine::Recover()
+{
+  TWCR = 0;
+
+  // The lines are open drain, so they're only ever driven low or left to the pull ups.
+  for (auto i = 0; i < 9 && digitalRead(SDA) == LOW; i++)
+  {
+    digitalWrite(SCL, LOW);
+    pinMode(SCL, OUTPUT);
+    delayMicroseconds(5);
+    pinMode(SCL, INPUT_PULLUP);
+    delayMicroseconds(5);
+  }
+
+  digitalWrite(SDA, LOW);
+  pinMode(SDA, OUTPUT);
+  delayMicroseconds(5);
+  pinMode(SDA, INPUT_PULLUP);
+  delayMicroseconds(5);
+
+  TWCR = _BV(TWEN);
+
+  Finish(I2CStatus::Failed);
+  if (_count)
+  {
+    Start();
+  }
+  else
+  {
+    _busy = false;
+  }
+}
+
+/**
+ * @brief Starts the transaction at the front of the queue. Must be called with
+ * interrupts disabled.
+ *
+ */
+void I2CEngine::Start()
+{
+  _busy = true;
+  _index = 0;
+  _registerSent = false;
+
+  auto stopStart = micros();
+  while ((TWCR & _BV(TWSTO)) && micros() - stopStart < I2C_STOP_TIMEOUT_US)
+    ; // wait here for the previous stop to finish
+
+  _activeSince = micros();
+  TWCR = TWCR_START;
+}
+
+/**
+ * @brief Finishes the active transaction and moves on to the next one in the queue,
+ * if there is one.
+ *
+ * @param status The result of the transaction.
+ */
+void I2CEngine::Complete(I2CStatus status)
+{
+  Finish(status);
+
+  if (_count)
+  {
+    _index = 0;
+    _registerSent = false;
+    _activeSince = micros();
+    TWCR = TWCR_STOP_START;
+  }
+  else
+  {
+    _busy = false;
+    TWCR = TWCR_STOP;
+  }
+}
+
+/**
+ * @brief Sets the result of the active transaction, queues its callback and takes it
+ * off the queue. Must be called with interrupts disabled.
+ *
+ * @param status The result of the transaction.
+ */
+void I2CEngine::Finish(I2CStatus status)
+{
+  auto transaction = _queue[_active];
+
+  if (transaction->callback)
+  {
+    _completed[(_completedHead + _completedCount) % I2C_QUEUE_LENGTH] = transaction;
+    _completedCount++;
+  }
+  transaction->status = status;
+  if (status == I2CStatus::Failed)
+  {
+    CountError(transaction->address);
+  }
+
+  _active = (_active + 1) % I2C_QUEUE_LENGTH;
+  _count--;
+}
+
+/**
+ * @brief Counts a failed transaction against its device address. Must be called
+ * with interrupts disabled.
+ *
+ * @param address The address of the device the transaction was for.
+ */
+void I2CEngine::CountError(uint8_t address)
+{
+  for (auto slot = 0; slot < I2C_ERROR_SLOTS; slot++)
+  {
+    if (_errorCounts[slot] == 0)
+    {
+      _errorAddresses[slot] = address;
+    }
+
+    if (_errorAddresses[slot] == address)
+    {
+      if (_errorCounts[slot] != UINT16_MAX)
+      {
+        _errorCounts[slot]++;
+      }
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Returns the device address whose failed transactions are counted in a slot.
+ *
+ * @param slot The slot, from 0 to I2C_ERROR_SLOTS - 1.
+ * @return uint8_t The address, only meaningful if the slot's count isn't 0.
+ */
+uint8_t I2CEngine::ErrorAddress(uint8_t slot)
+{
+  return _errorAddresses[slot];
+}
+
+/**
+ * @brief Returns the number of failed transactions counted in a slot.
+ *
+ * @param slot The slot, from 0 to I2C_ERROR_SLOTS - 1.
+ * @return uint16_t The number of failed transactions, 0 if the slot is unused.
+ */
+uint16_t I2CEngine::ErrorCount(uint8_t slot)
+{
+  uint16_t count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    count = _errorCounts[slot];
+  }
+  return count;
+}
+
+/**
+ * @brief Moves the active transaction along each time the TWI hardware finishes a step.
+ *
+ */
+void I2CEngine::HandleInterrupt()
+{
+  auto transaction = _queue[_active];
+
+  switch (TW_STATUS)
+  {
+  case TW_START:
+  {
+    TWDR = (transaction->address << 1) | TW_WRITE;
+    TWCR = TWCR_NEXT;
+    break;
+  }
+  case TW_REP_START:
+  {
+    TWDR = (transaction->address << 1) | TW_READ;
+    TWCR = TWCR_NEXT;
+    break;
+  }
+  case TW_MT_SLA_ACK:
+  case TW_MT_DATA_ACK:
+  {
+    if (!_registerSent)
+    {
+      TWDR = transaction->reg;
+      TWCR = TWCR_NEXT;
+      _registerSent = true;
+    }
+    else if (transaction->read)
+    {
+      // Switch over to reading with a repeated start.
+      TWCR = TWCR_START;
+    }
+    else if (_index < transaction->length)
+    {
+      TWDR = transaction->buffer[_index++];
+      TWCR = TWCR_NEXT;
+    }
+    else
+    {
+      Complete(I2CStatus::Done);
+    }
+    break;
+  }
+  case TW_MR_SLA_ACK:
+  {
+    // Every byte but the last is acknowledged.
+    TWCR = (transaction->length > 1) ? TWCR_NEXT_ACK : TWCR_NEXT;
+    break;
+  }
+  case TW_MR_DATA_ACK:
+  {
+    transaction->buffer[_index++] = TWDR;
+    TWCR = (_index < transaction->length - 1) ? TWCR_NEXT_ACK : TWCR_NEXT;
+    break;
+  }
+  case TW_MR_DATA_NACK:
+  {
+    transaction->buffer[_index++] = TWDR;
+    Complete(I2CStatus::Done);
+    break;
+  }
+  default:
+  {
+    // A device that doesn't acknowledge, lost arbitration or a bus error all end
+    // the transaction.
+    Complete(I2CStatus::Failed);
+    break;
+  }
+  }
+}
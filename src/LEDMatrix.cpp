@@ -1,21 +1,47 @@
 
 #include <Arduino.h>
-#include <Wire.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
 #include <util/atomic.h>
 
+#include "I2CEngine.h"
 #include "LEDMatrix.h"
 
 using namespace IS31FL3733;
 
+// Maps linear brightness levels to PWM duty cycles so fades and dimmer settings
+// look even to the eye (gamma 2.2). Every level above zero keeps the LEDs lit.
+const uint8_t GammaTable[256] PROGMEM = {
+      0,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+      3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+      6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+     12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+     20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+     30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+     42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+     56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+     73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+     91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+    113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+    137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+    163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+    192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+    223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255,
+};
+
+// Written to the page select write lock register to unlock the page select register for one write.
+static uint8_t pageUnlockKey = 0xC5;
+
 uint8_t completedABMCount = 0;
 volatile uint32_t seed;
 volatile int8_t nrot;
 
 // This method of generating a random seed comes from
 // https://sites.google.com/site/astudyofentropy/project-definition/timer-jitter-entropy-sources/entropy-library/arduino-random-seed
-void CreateTrulyRandomSeed()
+// The seed is collected in the background from the watchdog timer interrupt, which
+// takes roughly half a second, so startup doesn't have to wait for it.
+void StartRandomSeed()
 {
   seed = 0;
   nrot = 32; // Must be at least 4, but more increased the uniformity of the produced
@@ -28,16 +54,15 @@ void CreateTrulyRandomSeed()
   _WD_CONTROL_REG |= (1 << _WD_CHANGE_BIT) | (1 << WDE);
   _WD_CONTROL_REG = (1 << WDIE);
   sei();
+}
 
-  while (nrot > 0)
-    ; // wait here until seed is created
-
-  // The following five lines turn off the watch dog timer interrupt
-  cli();
-  MCUSR = 0;
-  _WD_CONTROL_REG |= (1 << _WD_CHANGE_BIT) | (0 << WDE);
-  _WD_CONTROL_REG = (0 << WDIE);
-  sei();
+/**
+ * @brief Checks whether the watchdog timer interrupt has finished collecting the seed.
+ *
+ */
+bool IsRandomSeedReady()
+{
+  return nrot <= 0;
 }
 
 ISR(WDT_vect)
@@ -45,6 +70,15 @@ ISR(WDT_vect)
   nrot--;
   seed = seed << 8;
   seed = seed ^ TCNT1L;
+
+  if (nrot <= 0)
+  {
+    // The following three lines turn off the watch dog timer interrupt. Interrupts
+    // are already disabled in here.
+    MCUSR = 0;
+    _WD_CONTROL_REG |= (1 << _WD_CHANGE_BIT) | (0 << WDE);
+    _WD_CONTROL_REG = (0 << WDIE);
+  }
 }
 
 /**
@@ -54,19 +88,11 @@ ISR(WDT_vect)
  * @param reg_addr Address of the register to read from.
  * @param buffer Buffer to read the data into.
  * @param length Length of the buffer.
- * @return uint8_t
+ * @return uint8_t The number of bytes read.
  */
 uint8_t i2c_read_reg(const uint8_t i2c_addr, const uint8_t reg_addr, uint8_t *buffer, const uint8_t length)
 {
-  Wire.beginTransmission(i2c_addr);
-  Wire.write(reg_addr);
-  Wire.endTransmission();
-  byte bytesRead = Wire.requestFrom(i2c_addr, length);
-  for (auto i = 0; i < bytesRead && i < length; i++)
-  {
-    buffer[i] = Wire.read();
-  }
-  return bytesRead;
+  return i2c.Read(i2c_addr, reg_addr, buffer, length) ? length : 0;
 }
 
 /**
@@ -80,12 +106,7 @@ uint8_t i2c_read_reg(const uint8_t i2c_addr, const uint8_t reg_addr, uint8_t *bu
  */
 uint8_t i2c_write_reg(const uint8_t i2c_addr, const uint8_t reg_addr, const uint8_t *buffer, const uint8_t count)
 {
-  Wire.beginTransmission(i2c_addr);
-  Wire.write(reg_addr);
-  byte bytesWritten = Wire.write(buffer, count);
-  Wire.endTransmission();
-
-  return bytesWritten;
+  return i2c.Write(i2c_addr, reg_addr, buffer, count) ? count : 0;
 }
 
 /**
@@ -99,6 +120,7 @@ uint8_t i2c_write_reg(const uint8_t i2c_addr, const uint8_t reg_addr, const uint
 LEDMatrix::LEDMatrix(ADDR addr1, ADDR addr2, uint8_t sdbPin, uint8_t intbPin, LEDEvent eventHandler)
 {
   _driver = new IS31FL3733Driver(addr1, addr2, &i2c_read_reg, &i2c_write_reg);
+  _i2cAddress = 0x50 | (static_cast<uint8_t>(addr2) << 2) | static_cast<uint8_t>(addr1);
   _eventHandler = eventHandler;
   _sdbPin = sdbPin;
   _intbPin = intbPin;
@@ -110,23 +132,295 @@ void LEDMatrix::HandleInterrupt()
 }
 
 /**
- * @brief Sets the IC PWM for all LEDs to the specified brightness.
+ * @brief Fades all LEDs to the specified brightness. In power save the brightness
+ * is kept for when power save is turned off.
  *
  * @param brightness The brightness to use.
  */
 void LEDMatrix::SetBrightness(uint8_t brightness)
 {
-  _driver->SetLEDMatrixPWM(brightness);
+  _brightness = brightness;
+
+  if (!_powerSave)
+  {
+    StartFade(brightness);
+  }
+}
+
+/**
+ * @brief Sets the PWM for all LEDs to a gamma corrected brightness level. Only
+ * rows that actually change get written to the driver.
+ *
+ * @param level The linear brightness level.
+ */
+void LEDMatrix::ApplyLevel(uint8_t level)
+{
+  auto pwm = pgm_read_byte(&GammaTable[level]);
+  for (auto sw = 0; sw < SW_LINES; sw++)
+  {
+    for (auto cs = 0; cs < CS_LINES; cs++)
+    {
+      SetLEDPWM(cs, sw, pwm);
+    }
+  }
+
+  _level = level;
+}
+
+/**
+ * @brief Starts a fade from the current level to a new one. The fade is timed from
+ * the next pass of the main loop, so its start and its steps all come from the same
+ * currentMs clock.
+ *
+ * @param level The linear brightness level to fade to.
+ */
+void LEDMatrix::StartFade(uint8_t level)
+{
+  _fadeFrom = _level;
+  _fadeTo = level;
+  _fadeStartPending = true;
 }
 
 /**
- * @brief Turns power save mode on or off.
+ * @brief Moves a running fade along to where it should be by now. A new level is
+ * applied at most every LED_FADE_STEP_MS and only once the previous one has been
+ * written out, so a fade never queues more than one PWM page worth of I2C writes
+ * and the flush limit in Loop() bounds the bytes per pass.
+ *
+ * @param currentMs The time of the current pass of the main loop, from millis().
+ */
+void LEDMatrix::StepFade(uint32_t currentMs)
+{
+  if (_fadeStartPending)
+  {
+    _fadeStart = currentMs;
+    _fadeStartPending = false;
+  }
+
+  if (_level == _fadeTo || _pwmDirtyRows || currentMs - _lastFadeStep < LED_FADE_STEP_MS)
+  {
+    return;
+  }
+
+  auto elapsed = currentMs - _fadeStart;
+  auto level = _fadeTo;
+  if (elapsed < LED_FADE_LENGTH_MS)
+  {
+    level = _fadeFrom + (static_cast<int16_t>(_fadeTo) - _fadeFrom) * static_cast<int32_t>(elapsed) / LED_FADE_LENGTH_MS;
+  }
+
+  if (level != _level)
+  {
+    ApplyLevel(level);
+    _lastFadeStep = currentMs;
+  }
+}
+
+/**
+ * @brief Sets the PWM for a single LED. The change is written to the driver
+ * from Loop().
+ *
+ * @param cs The CS line of the LED.
+ * @param sw The SW line of the LED.
+ * @param value The PWM duty cycle.
+ */
+void LEDMatrix::SetLEDPWM(uint8_t cs, uint8_t sw, uint8_t value)
+{
+  if (_pwm[sw][cs] == value)
+  {
+    return;
+  }
+
+  _pwm[sw][cs] = value;
+  _pwmDirtyRows |= bit(sw);
+}
+
+/**
+ * @brief Turns a single LED on or off. The change is written to the driver
+ * from Loop().
+ *
+ * @param cs The CS line of the LED.
+ * @param sw The SW line of the LED.
+ * @param state True to turn the LED on, false to turn it off.
+ */
+void LEDMatrix::SetLEDState(uint8_t cs, uint8_t sw, bool state)
+{
+  auto &states = _states[sw][cs / 8];
+  auto mask = bit(cs % 8);
+
+  if (static_cast<bool>(states & mask) == state)
+  {
+    return;
+  }
+
+  state ? states |= mask : states &= ~mask;
+  _stateDirtyRows |= bit(sw);
+}
+
+/**
+ * @brief Turns power save mode on or off by fading the LEDs out, or back in to
+ * the last brightness set.
  *
  * @param state True to turn power save mode on, false to turn it off.
  */
 void LEDMatrix::SetPowerSaveMode(bool state)
 {
-  state ? _ledState = LedState::TurnOnPowerSave : _ledState = LedState::TurnOffPowerSave;
+  if (_powerSave == state)
+  {
+    return;
+  }
+
+  _powerSave = state;
+  StartFade(state ? 0 : _brightness);
+}
+
+/**
+ * @brief Queues a background write to the LED driver.
+ *
+ * @param transaction The transaction to use for the write.
+ * @param reg The register to start writing at.
+ * @param buffer The data to write, which must not go away before the write completes.
+ * @param length The number of bytes to write.
+ * @return true if the write was queued.
+ */
+bool LEDMatrix::SubmitWrite(I2CTransaction &transaction, uint8_t reg, uint8_t *buffer, uint8_t length)
+{
+  transaction = {_i2cAddress, reg, buffer, length, false, nullptr, nullptr, I2CStatus::Idle};
+  return i2c.Submit(&transaction);
+}
+
+/**
+ * @brief Queues the background writes that select the register page for the
+ * paged writes queued after them.
+ *
+ * @param page The page to select.
+ * @return true if both writes were queued.
+ */
+bool LEDMatrix::SubmitPageSelect(LEDPage page)
+{
+  _page = page;
+  return SubmitWrite(_pageUnlock, static_cast<uint8_t>(COMMONREGISTER::PSWL), &pageUnlockKey, 1) &&
+         SubmitWrite(_pageSelect, static_cast<uint8_t>(COMMONREGISTER::PSR), &_page, 1);
+}
+
+/**
+ * @brief Checks whether any of the writes from the last flush are still waiting to go out.
+ *
+ */
+bool LEDMatrix::IsFlushPending()
+{
+  if (_pageUnlock.status == I2CStatus::Pending || _pageSelect.status == I2CStatus::Pending)
+  {
+    return true;
+  }
+
+  for (auto &rowWrite : _rowWrites)
+  {
+    if (rowWrite.status == I2CStatus::Pending)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * @brief Queues background writes of dirty framebuffer rows, up to LED_ROWS_PER_LOOP
+ * of them, once the previous flush has gone out. The dirty part of the on/off page
+ * is small enough to go in a single I2C write and is written on its own. PWM rows
+ * are written one row per I2C write. Rows that can't be queued stay dirty for the
+ * next flush.
+ *
+ */
+void LEDMatrix::FlushRows()
+{
+  if (IsFlushPending())
+  {
+    return;
+  }
+
+  if (_stateDirtyRows)
+  {
+    uint8_t first = 0;
+    uint8_t last = SW_LINES - 1;
+    while (!bitRead(_stateDirtyRows, first))
+    {
+      first++;
+    }
+    while (!bitRead(_stateDirtyRows, last))
+    {
+      last--;
+    }
+
+    if (SubmitPageSelect(LEDPage::LEDOnOffPage) &&
+        SubmitWrite(_rowWrites[0], first * LED_STATE_BYTES_PER_ROW, _states[first], (last - first + 1) * LED_STATE_BYTES_PER_ROW))
+    {
+      _stateDirtyRows = 0;
+    }
+    return;
+  }
+
+  if (_pwmDirtyRows && SubmitPageSelect(LEDPage::LEDPWMPage))
+  {
+    uint8_t rows = 0;
+    for (auto sw = 0; sw < SW_LINES && rows < LED_ROWS_PER_LOOP; sw++)
+    {
+      if (bitRead(_pwmDirtyRows, sw))
+      {
+        if (!SubmitWrite(_rowWrites[rows], sw * CS_LINES, _pwm[sw], CS_LINES))
+        {
+          return;
+        }
+        bitClear(_pwmDirtyRows, sw);
+        rows++;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Selects the register page for the paged writes that follow and waits for
+ * it to go out.
+ *
+ * @param page The page to select.
+ * @return true if the page was selected.
+ */
+bool LEDMatrix::WritePageSelect(LEDPage page)
+{
+  _page = page;
+  return i2c.Write(_i2cAddress, static_cast<uint8_t>(COMMONREGISTER::PSWL), &pageUnlockKey, 1) &&
+         i2c.Write(_i2cAddress, static_cast<uint8_t>(COMMONREGISTER::PSR), &_page, 1);
+}
+
+/**
+ * @brief Writes every dirty framebuffer row to the driver and waits for the writes
+ * to go out. A stuck bus fails each write after I2C_TIMEOUT_US, so this always
+ * returns. Rows that fail to go out stay dirty for FlushRows().
+ *
+ */
+void LEDMatrix::WriteDirtyRows()
+{
+  if (_stateDirtyRows && WritePageSelect(LEDPage::LEDOnOffPage) &&
+      i2c.Write(_i2cAddress, 0, _states[0], sizeof(_states)))
+  {
+    _stateDirtyRows = 0;
+  }
+
+  if (_pwmDirtyRows && WritePageSelect(LEDPage::LEDPWMPage))
+  {
+    for (auto sw = 0; sw < SW_LINES; sw++)
+    {
+      if (bitRead(_pwmDirtyRows, sw))
+      {
+        if (!i2c.Write(_i2cAddress, sw * CS_LINES, _pwm[sw], CS_LINES))
+        {
+          return;
+        }
+        bitClear(_pwmDirtyRows, sw);
+      }
+    }
+  }
 }
 
 /**
@@ -146,18 +440,37 @@ void LEDMatrix::Init()
   _driver->Init();
 
   _driver->SetGCC(127); // Set global current control to half.
-  SetBrightness(255);   // Set PWM for all LEDs to full power.
 
-  // Randomly assign one of the three ABM patterns to each button
-  CreateTrulyRandomSeed();
-  for (auto i = 0; i < CS_LINES; i++)
+  // Start with every LED on at full power without fading in. The framebuffer starts
+  // out zeroed so every row gets marked dirty and is written out here. Anything the
+  // driver doesn't take stays dirty and goes out from Loop() instead.
+  ApplyLevel(_brightness);
+  _fadeTo = _brightness;
+  for (auto sw = 0; sw < SW_LINES; sw++)
   {
-    for (auto j = 0; j < SW_LINES; j++)
+    for (auto cs = 0; cs < CS_LINES; cs++)
     {
-      _driver->SetLEDSingleMode(i, j, static_cast<LED_MODE>(random(1, 3)));
+      SetLEDState(cs, sw, true);
     }
   }
-  _driver->SetLEDMatrixState(LED_STATE::ON); // Turn on all the LEDs.
+  WriteDirtyRows();
+
+  // Seed collection runs in the background. The ABM patterns are assigned and
+  // started from Loop() once it's done.
+  StartRandomSeed();
+}
+
+/**
+ * @brief Configures the ABM startup animation. It starts running from Loop() once
+ * the random seed is ready. Only the first call does anything.
+ *
+ */
+void LEDMatrix::Start()
+{
+  if (_ledState != LedState::ABMNotStarted)
+  {
+    return;
+  }
 
   ABM_CONFIG ABM1;
   ABM_CONFIG ABM2;
@@ -192,11 +505,54 @@ void LEDMatrix::Init()
   _driver->ConfigABM(ABM_NUM::NUM_3, &ABM3);             // Tell the IC the ABM parameters.
   _driver->WriteCommonReg(COMMONREGISTER::IMR, IMR_IAB); // Enable interrupts when ABM completes and auto-clear them after 8ms.
 
+  _ledState = LedState::WaitingForSeed;
+}
+
+/**
+ * @brief Randomly assigns one of the three ABM patterns to each LED and starts ABM.
+ *
+ */
+void LEDMatrix::StartABM()
+{
+  randomSeed(seed);
+  WriteLEDModes(true);
+
   _ledState = LedState::ABMRunning;
   _driver->StartABM(); // Start ABM mode operation.
 }
 
-void LEDMatrix::Loop()
+/**
+ * @brief Sets the mode of every LED. The mode page is built a row at a time and
+ * each row goes out in a single auto-incrementing I2C write, instead of one
+ * addressed write per LED.
+ *
+ * @param randomABM True to give each LED one of the ABM patterns at random, false
+ * to put every LED back in PWM mode.
+ */
+void LEDMatrix::WriteLEDModes(bool randomABM)
+{
+  uint8_t page = LEDPage::LEDABMPage;
+  uint8_t row[CS_LINES];
+
+  i2c.Write(_i2cAddress, static_cast<uint8_t>(COMMONREGISTER::PSWL), &pageUnlockKey, 1);
+  i2c.Write(_i2cAddress, static_cast<uint8_t>(COMMONREGISTER::PSR), &page, 1);
+
+  for (auto sw = 0; sw < SW_LINES; sw++)
+  {
+    for (auto cs = 0; cs < CS_LINES; cs++)
+    {
+      row[cs] = static_cast<uint8_t>(randomABM ? static_cast<LED_MODE>(random(1, 3)) : LED_MODE::PWM);
+    }
+    i2c.Write(_i2cAddress, sw * CS_LINES, row, CS_LINES);
+  }
+}
+
+/**
+ * @brief Runs the LED state machine and writes out framebuffer changes.
+ *
+ * @param currentMs The time of the current pass of the main loop, from millis().
+ */
+void LEDMatrix::Loop(uint32_t currentMs)
 {
   // Simple finite state machine to switch LEDs on after ABM finishes running.
   switch (_ledState)
@@ -205,6 +561,14 @@ void LEDMatrix::Loop()
   {
     break;
   }
+  case LedState::WaitingForSeed:
+  {
+    if (IsRandomSeedReady())
+    {
+      StartABM();
+    }
+    break;
+  }
   case LedState::ABMRunning:
   {
     break;
@@ -230,30 +594,19 @@ void LEDMatrix::Loop()
 
     if (completedABMCount == 3)
     {
-      _driver->SetLEDMatrixMode(LED_MODE::PWM);
+      WriteLEDModes(false);
       _ledState = LedState::LEDOn;
     }
     break;
   }
-  case LedState::TurnOnPowerSave:
-  {
-    _driver->SetLEDMatrixState(LED_STATE::OFF);
-    _ledState = LedState::LEDOff;
-    break;
-  }
-  case LedState::TurnOffPowerSave:
-  {
-    _driver->SetLEDMatrixState(LED_STATE::ON);
-    _ledState = LedState::LEDOn;
-    break;
-  }
   case LedState::LEDOn:
   {
     break;
   }
-  case LedState::LEDOff:
-  {
-    break;
-  }
   }
+
+  // Queue framebuffer changes a few rows at a time. They go out on the bus in
+  // the background while the rest of the main loop carries on.
+  StepFade(currentMs);
+  FlushRows();
 }
\ No newline at end of file
@@ -5,14 +5,14 @@ ButtonEvent MFButton::_handler = NULL;
 MFButton::MFButton(uint8_t pin, const __FlashStringHelper *name)
 {
   _pin = pin;
+  _location = GetPinLocation(pin);
   _name = name;
   _state = 1;
   pinMode(_pin, INPUT_PULLUP); // set pin to input
 }
 
-void MFButton::Update()
+void MFButton::Update(uint8_t newState)
 {
-  uint8_t newState = (uint8_t)digitalRead(_pin);
   if (newState != _state)
   {
     _state = newState;
@@ -12,6 +12,8 @@
 // 18.01.2014 created by Matthias Hertel
 // -----
 
+#include <util/atomic.h>
+
 #include "MFEncoder.h"
 
 // The array holds the values -1 for the entries where a position was decremented,
@@ -49,15 +51,31 @@ const encoderType encoderTypes[]{
     {{true, true, true, true}, 0},
 };
 
+// Turns slower than 70ms per detent move one step per detent, faster turns
+// move up to 8 steps per detent.
+const AccelerationStep DefaultAccelerationCurve[] PROGMEM = {
+    {20, 8},
+    {40, 4},
+    {70, 2},
+    {UINT16_MAX, 1},
+};
+
 EncoderEvent MFEncoder::_handler = NULL;
 
-MFEncoder::MFEncoder(uint8_t pin1, uint8_t pin2, uint8_t TypeEncoder, const __FlashStringHelper *name)
+MFEncoder::MFEncoder(uint8_t pin1, uint8_t pin2, uint8_t TypeEncoder, const __FlashStringHelper *name,
+                     const AccelerationStep *curve)
 {
   _pos = 0;
+#ifdef MF_ENC_DELTA_MESSAGES
+  _pendingCount = 0;
+#endif
   _name = name;
   _pin1 = pin1;
   _pin2 = pin2;
+  _location1 = GetPinLocation(pin1);
+  _location2 = GetPinLocation(pin2);
   _encoderType = encoderTypes[TypeEncoder];
+  _curve = curve;
 
   pinMode(_pin1, INPUT_PULLUP);
   pinMode(_pin2, INPUT_PULLUP);
@@ -65,23 +83,56 @@ MFEncoder::MFEncoder(uint8_t pin1, uint8_t pin2, uint8_t TypeEncoder, const __Fl
   _oldState = 0;
   _position = 0;
   _positionExt = 0;
-  _detentCounter = 0;
-  _positionTimePrev = 0; // for first startup avoid calculation of a high speed, _positionTimePrev
-  _positionTime = 500;   // and _positionTime must be initialized to avoid that they have the same value
   _initialized = true;
 }
 
-void MFEncoder::Update()
+/**
+ * @brief Enables pin change interrupts for the encoder pins so every quadrature
+ * edge is decoded by Tick() as it happens. Pins that aren't on a pin change port
+ * (pin 5 on the ATmega32U4) are still picked up by the scan in the main loop.
+ *
+ */
+void MFEncoder::EnablePinChangeInterrupts()
+{
+  uint8_t pins[] = {_pin1, _pin2};
+  for (auto pin : pins)
+  {
+    auto pcicr = digitalPinToPCICR(pin);
+    if (pcicr == nullptr)
+    {
+      continue;
+    }
+
+    *digitalPinToPCMSK(pin) |= bit(digitalPinToPCMSKbit(pin));
+    *pcicr |= bit(digitalPinToPCICRbit(pin));
+  }
+}
+
+void MFEncoder::Update(uint32_t currentMs)
 {
   if (!_initialized)
     return;
 
-  Tick();
+  // The position is accumulated by Tick() from the pin change interrupt and the
+  // scan in the main loop, so all that's needed here is a consistent read of it.
+  int16_t pos;
+  uint16_t interval;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    pos = _positionExt;
+    interval = _velocity.Interval();
+  }
 
-  int16_t pos = GetPosition();
   if (pos == _pos)
   {
-    // nothing happened
+#ifdef MF_ENC_DELTA_MESSAGES
+    // nothing happened, but a pending event may have waited long enough
+    if (_pendingCount && currentMs - _pendingSince >= MF_ENC_COALESCE_MS)
+    {
+      SendEvent(_pendingEventId, _pendingCount);
+      _pendingCount = 0;
+    }
+#endif
     return;
   }
 
@@ -91,33 +142,53 @@ void MFEncoder::Update()
   if (delta < 0)
     dir = false;
 
-  if (_handler)
+  uint8_t detents = min(abs(delta), UINT8_MAX);
+  uint8_t multiplier = GetAccelerationMultiplier(_curve, interval);
+  uint8_t eventId;
+  uint8_t count;
+#ifdef MF_ENC_DELTA_MESSAGES
+  // The count goes to the host as is, so the acceleration is applied to it here.
+  eventId = dir ? encLeft : encRight;
+  count = min(detents * multiplier, UINT8_MAX);
+#else
+  // Stock MobiFlight applies its own step size to fast events, so the curve
+  // only decides whether the detents are reported as fast.
+  if (multiplier > 1)
   {
-    if (abs(delta) < (MF_ENC_FAST_LIMIT))
-    {
-      // slow turn detected
-      if (dir)
-      {
-        (*_handler)(encLeft, _pin1, _name);
-      }
-      else
-      {
-        (*_handler)(encRight, _pin2, _name);
-      }
-    }
-    else
-    {
-      // fast turn detected
-      if (dir)
-      {
-        (*_handler)(encLeftFast, _pin1, _name);
-      }
-      else
-      {
-        (*_handler)(encRightFast, _pin2, _name);
-      }
-    }
+    eventId = dir ? encLeftFast : encRightFast;
+  }
+  else
+  {
+    eventId = dir ? encLeft : encRight;
   }
+  count = detents;
+#endif
+
+#ifdef MF_ENC_DELTA_MESSAGES
+  // Steps only combine with a pending event of the same kind, so a change of
+  // direction or speed sends what's pending first.
+  if (_pendingCount && (eventId != _pendingEventId || _pendingCount > UINT8_MAX - count))
+  {
+    SendEvent(_pendingEventId, _pendingCount);
+    _pendingCount = 0;
+  }
+
+  if (!_pendingCount)
+  {
+    _pendingEventId = eventId;
+    _pendingSince = currentMs;
+  }
+  _pendingCount += count;
+
+  if (currentMs - _pendingSince >= MF_ENC_COALESCE_MS)
+  {
+    SendEvent(_pendingEventId, _pendingCount);
+    _pendingCount = 0;
+  }
+#else
+  // Each step goes out as its own message anyway, so holding them back gains nothing.
+  SendEvent(eventId, count);
+#endif
 
   // protect from overflow
   if ((dir && (pos + delta * 2) > MF_ENC_MAX) || (!dir && (pos - delta * 2) < -MF_ENC_MAX))
@@ -128,45 +199,39 @@ void MFEncoder::Update()
   _pos = pos;
 }
 
-void MFEncoder::Tick(void)
+/**
+ * @brief Sends a number of steps as a single event.
+ *
+ * @param eventId The kind of step.
+ * @param count The number of steps.
+ */
+void MFEncoder::SendEvent(uint8_t eventId, uint8_t count)
 {
-  bool sig1 = !digitalRead(_pin1); // to keep backwards compatibility for encoder type digitalRead must be negated
-  bool sig2 = !digitalRead(_pin2); // to keep backwards compatibility for encoder type digitalRead must be negated
-  int _speed = 0;
-  uint32_t currentMs = millis();
-
-  int8_t thisState = sig1 | (sig2 << 1);
-
-  if (currentMs - _lastFastDec > 100 && _detentCounter > 1)
+  if (_handler)
   {
-    _lastFastDec = currentMs;
-    _detentCounter--;
-  }
-  else if (currentMs - _positionTimePrev > 500)
-  { // if more than 80ms no step detected, set fast acceleration to 0
-    _lastFastDec = currentMs;
-    _detentCounter = 0;
+    auto pin = (eventId == encLeft || eventId == encLeftFast) ? _pin1 : _pin2;
+    (*_handler)(eventId, pin, _name, count);
   }
+}
 
-  if (_oldState != thisState)
-  {
+void MFEncoder::Tick(const PinSnapshot &pins, uint32_t currentMs)
+{
+  bool sig1 = !pins.IsHigh(_location1); // to keep backwards compatibility for encoder type the pin state must be negated
+  bool sig2 = !pins.IsHigh(_location2); // to keep backwards compatibility for encoder type the pin state must be negated
 
-    if (_detentCounter > 6)
-    { // at minimum 6 detents have to be detected before fast step can be detected
-      _speed = 51;
-    }
-    else
-    {
-      _speed = 1;
-    }
+  int8_t thisState = sig1 | (sig2 << 1);
 
-    _position += ((KNOBDIR[thisState | (_oldState << 2)] * _speed)) << _encoderType.resolutionShift;
+  if (_oldState != thisState)
+  {
+    _position += KNOBDIR[thisState | (_oldState << 2)];
     if (_encoderType.detents[thisState])
     {
-      _positionTimePrev = _positionTime;
-      _positionTime = currentMs;
-      _positionExt = _position >> _encoderType.resolutionShift;
-      _detentCounter = min(_detentCounter + 1, 12);
+      int16_t positionExt = _position >> _encoderType.resolutionShift;
+      if (positionExt != _positionExt)
+      {
+        _velocity.Detent(currentMs, positionExt > _positionExt ? 1 : -1);
+        _positionExt = positionExt;
+      }
     }
     _oldState = thisState;
   }
@@ -174,14 +239,22 @@ void MFEncoder::Tick(void)
 
 int16_t MFEncoder::GetPosition()
 {
-  return _positionExt;
+  int16_t position;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    position = _positionExt;
+  }
+  return position;
 }
 
 void MFEncoder::SetPosition(int16_t newPosition)
 {
-  // only adjust the external part of the position.
-  _position = ((newPosition >> _encoderType.resolutionShift) | (_position & 0x03));
-  _positionExt = newPosition;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    // only adjust the external part of the position.
+    _position = ((newPosition << _encoderType.resolutionShift) | (_position & ((1 << _encoderType.resolutionShift) - 1)));
+    _positionExt = newPosition;
+  }
 }
 
 void MFEncoder::attachHandler(EncoderEvent newHandler)
@@ -1,10 +1,15 @@
 #include <Arduino.h>
-#include <Wire.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 
 #include "CmdMessenger.h"
+#include "Debouncer.h"
 #include "ExpanderButtonNames.h"
+#include "EventQueue.h"
 #include "ExpanderManager.h"
+#include "I2CEngine.h"
 #include "LEDMatrix.h"
+#include "LoopProfiler.h"
 #include "MFButton.h"
 #include "MFEEPROM.h"
 #include "MFEncoder.h"
@@ -23,34 +28,185 @@ static constexpr uint8_t MEM_OFFSET_SERIAL = 0;
 static constexpr uint8_t MEM_LEN_SERIAL = 11;
 char serial[MEM_LEN_SERIAL];
 
+// Microseconds from the start of setup() to the end of each startup stage.
+uint32_t bootTimes[BootStage::BOOT_STAGE_COUNT];
+uint32_t bootStartMicros;
+uint32_t bootStartMillis;
+
 // I2C Addresses for the IO expanders.
 static constexpr uint8_t MCP1_I2C_ADDRESS = 0x20; // Address for first MCP23017.
 static constexpr uint8_t MCP2_I2C_ADDRESS = 0x21; // Address for second MCP23017.
 
 // Time durations.
-static constexpr unsigned long POWER_SAVING_TIME_SECS = 60 * 60; // Inactivity timeout for LEDs. One hour (60 minutes * 60 seconds).
+static constexpr unsigned long POWER_SAVING_TIME_MS = 60 * 60 * 1000UL; // Inactivity timeout for LEDs. One hour (60 minutes * 60 seconds * 1000 ms).
 static constexpr unsigned long PRESS_AND_HOLD_LENGTH_MS = 500;   // Length of time a key must be held for a long press.
-static constexpr unsigned long BUTTON_DEBOUNCE_LENGTH_MS = 10;   // Number of milliseconds between checking for button presses.
+static constexpr unsigned long BUTTON_SCAN_INTERVAL_MS = 2;      // Number of milliseconds between checking for button presses.
+
+// MobiFlight-style devices. The definitions are stored in flash and are used both to
+// create the devices in AddMFDevices() and to report them to MobiFlight in OnGetConfig(),
+// so the two can't drift apart.
+struct ButtonDefinition
+{
+  uint8_t pin;
+  const char *name;
+};
+
+struct EncoderDefinition
+{
+  uint8_t pin1;
+  uint8_t pin2;
+  uint8_t type;
+  const char *name;
+  const AccelerationStep *curve;
+};
+
+static constexpr char LeftName[] PROGMEM = "LEFT";
+static constexpr char RightName[] PROGMEM = "RIGHT";
+static constexpr char UpName[] PROGMEM = "UP";
+static constexpr char DownName[] PROGMEM = "DOWN";
+static constexpr char CenterName[] PROGMEM = "CTR";
+static constexpr char Encoder1Name[] PROGMEM = "ENC_1";
+static constexpr char Encoder2Name[] PROGMEM = "ENC_2";
+static constexpr char BrightnessName[] PROGMEM = "Brightness";
 
-// MobiFlight-style devices.
 static constexpr uint8_t MAX_BUTTONS = 5;
 MFButton buttons[MAX_BUTTONS];
+Debouncer<uint8_t> buttonDebouncer(0xFF);
+static_assert(MAX_BUTTONS <= 8, "buttonDebouncer holds one bit per button");
+
+const ButtonDefinition ButtonDefinitions[MAX_BUTTONS] PROGMEM = {
+    {PIN_LEFT, LeftName},
+    {PIN_RIGHT, RightName},
+    {PIN_UP, UpName},
+    {PIN_DOWN, DownName},
+    {PIN_CTR, CenterName},
+};
 
 static constexpr uint8_t MAX_ENCODERS = 2;
 MFEncoder encoders[MAX_ENCODERS];
 
+const EncoderDefinition EncoderDefinitions[MAX_ENCODERS] PROGMEM = {
+    {PIN_A, PIN_B, 2, Encoder1Name, DefaultAccelerationCurve},
+    {PIN_A_PRIME, PIN_B_PRIME, 2, Encoder2Name, DefaultAccelerationCurve},
+};
+
+// The data button and three mem buttons send a regular or long press on release.
+// 0 is DATA
+// 6 is MEM_1
+// 20 is MEM_3
+// 28 is MEM_2
+static constexpr uint8_t LONG_PRESS_BUTTONS[] = {0, 6, 20, 28};
+static constexpr uint8_t LONG_PRESS_BUTTON_COUNT = sizeof(LONG_PRESS_BUTTONS);
+
 // State variables.
+unsigned long longPressStart[LONG_PRESS_BUTTON_COUNT]; // When each long press button was pressed.
 unsigned long lastButtonPress = 0;
 unsigned long lastButtonUpdate = 0;
+// Input events waiting to be handled by DrainEvents(). Both MCPs can report a change
+// on every one of their keys in a single pass, so there's room for all of them.
+static constexpr uint8_t INPUT_EVENT_QUEUE_LENGTH = 32;
+EventQueue<InputEvent, INPUT_EVENT_QUEUE_LENGTH> inputEvents;
+
+// Timing of each loop() stage. Only built with LOOP_PROFILING defined, since the
+// histograms take LOOP_STAGE_COUNT * 36 bytes of RAM.
+#ifdef LOOP_PROFILING
+LoopProfiler<LoopStage::LOOP_STAGE_COUNT> loopProfiler;
+#define PROFILE_START_PASS() loopProfiler.StartPass()
+#define PROFILE_END_STAGE(stage) loopProfiler.EndStage(stage)
+#define PROFILE_END_PASS() loopProfiler.EndPass(LoopStage::kLoopPass)
+#else
+#define PROFILE_START_PASS()
+#define PROFILE_END_STAGE(stage)
+#define PROFILE_END_PASS()
+#endif
+
+// Runtime statistics reported by kGetStats, on top of the ones CmdMessenger, the
+// I2C engine and the event queue keep for themselves.
+uint32_t keyEvents = 0;         // Key and button presses and releases sent.
+uint32_t encoderSteps = 0;      // Encoder steps sent.
+uint32_t longestPassMillis = 0; // Longest time between the starts of two loop() passes.
+
+unsigned long loopMillis = 0; // millis() at the start of the current loop() pass, shared by everything the pass runs.
 auto powerSavingMode = false;
 
 // Communication & device controller variables.
 CmdMessenger cmdMessenger = CmdMessenger(Serial);
 MFEEPROM MFeeprom;
-ExpanderManager mcp1(MCP1_I2C_ADDRESS, OnButtonPress);
-ExpanderManager mcp2(MCP2_I2C_ADDRESS, OnButtonPress);
+ExpanderManager mcp1(MCP1_I2C_ADDRESS, MCP1_INT_PIN, OnMCP1Interrupt, OnButtonPress);
+ExpanderManager mcp2(MCP2_I2C_ADDRESS, MCP2_INT_PIN, OnMCP2Interrupt, OnButtonPress);
 LEDMatrix ledMatrix(ADDR::GND, ADDR::GND, LED_SDB_PIN, LED_INTB_PIN, OnLEDEvent);
 
+// Callbacks for the supported MobiFlight commands, indexed by MFMessage. The table lives in
+// flash so dispatching a command costs a single PROGMEM read and no RAM. Commands with a
+// nullptr entry are handled by OnUnknownCommand(). The IDs stock MobiFlight uses between
+// kResetBoard and the panel's own commands have no handler here and are padded out.
+const messengerCallbackFunction CommandCallbacks[] PROGMEM = {
+    nullptr,          // kInitModule
+    nullptr,          // kSetModule
+    OnSetPin,         // kSetPin
+    nullptr,          // 3
+    nullptr,          // 4
+    nullptr,          // kStatus
+    nullptr,          // kEncoderChange
+    nullptr,          // kButtonChange
+    nullptr,          // 8
+    OnGetInfo,        // kGetInfo
+    nullptr,          // kInfo
+    OnSetConfig,      // kSetConfig
+    OnGetConfig,      // kGetConfig
+    SendOk,           // kResetConfig
+    OnSaveConfig,     // kSaveConfig
+    nullptr,          // kConfigSaved
+    OnActivateConfig, // kActivateConfig
+    nullptr,          // kConfigActivated
+    nullptr,          // kSetPowerSavingMode
+    OnSetName,        // kSetName
+    OnGenNewSerial,   // kGenNewSerial
+    nullptr,          // 21
+    nullptr,          // 22
+    SendOk,           // kTrigger
+    OnResetBoard,     // kResetBoard
+    nullptr,          // 25
+    nullptr,          // 26
+    nullptr,          // 27
+    nullptr,          // 28
+    nullptr,          // 29
+    nullptr,          // 30
+    nullptr,          // 31
+    nullptr,          // 32
+    nullptr,          // 33
+    nullptr,          // 34
+    nullptr,          // 35
+    nullptr,          // 36
+    nullptr,          // 37
+    nullptr,          // 38
+    nullptr,          // 39
+    nullptr,          // 40
+    nullptr,          // 41
+    nullptr,          // 42
+    nullptr,          // 43
+    nullptr,          // 44
+    nullptr,          // 45
+    nullptr,          // 46
+    nullptr,          // 47
+    nullptr,          // 48
+    nullptr,          // 49
+    nullptr,          // 50
+    OnGetBootTimes,   // kGetBootTimes
+    nullptr,          // kBootTimes
+#ifdef LOOP_PROFILING
+    OnGetLoopTimes,   // kGetLoopTimes
+#else
+    nullptr,          // kGetLoopTimes
+#endif
+    nullptr,          // kLoopTimes
+    OnGetStats,       // kGetStats
+    nullptr,          // kStats
+};
+
+static_assert(sizeof(CommandCallbacks) / sizeof(CommandCallbacks[0]) == MFMessage::kStats + 1,
+              "CommandCallbacks must have an entry for every MFMessage");
+
 /**
  * @brief Registers callbacks for all supported MobiFlight commands.
  *
@@ -59,29 +215,34 @@ void attachCommandCallbacks()
 {
   // Attach callback methods
   cmdMessenger.attach(OnUnknownCommand);
-  cmdMessenger.attach(MFMessage::kSetPin, OnSetPin);
-  cmdMessenger.attach(MFMessage::kGetInfo, OnGetInfo);
-  cmdMessenger.attach(MFMessage::kGetConfig, OnGetConfig);
-  cmdMessenger.attach(MFMessage::kSetConfig, OnSetConfig);
-  cmdMessenger.attach(MFMessage::kResetConfig, SendOk);
-  cmdMessenger.attach(MFMessage::kSaveConfig, OnSaveConfig);
-  cmdMessenger.attach(MFMessage::kActivateConfig, OnActivateConfig);
-  cmdMessenger.attach(MFMessage::kSetName, OnSetName);
-  cmdMessenger.attach(MFMessage::kGenNewSerial, OnGenNewSerial);
-  cmdMessenger.attach(MFMessage::kTrigger, SendOk);
-  cmdMessenger.attach(MFMessage::kResetBoard, OnResetBoard);
-#ifdef DEBUG
-  cmdMessenger.attach(MFMessage::kGenerateConfig, OnGenerateConfig);
-#endif
+  cmdMessenger.attach(CommandCallbacks, sizeof(CommandCallbacks) / sizeof(CommandCallbacks[0]));
 }
 
 /**
- * @brief Handles an interrupt from the LEDMatrix.
+ * @brief Handles an interrupt from the LEDMatrix by queuing it for DrainEvents().
  *
  */
 void OnLEDEvent()
 {
-  ledMatrix.HandleInterrupt();
+  inputEvents.Push({millis(), InputSource::kSourceLEDMatrix, 0, 0, 0});
+}
+
+/**
+ * @brief Handles an interrupt from the first MCP.
+ *
+ */
+void OnMCP1Interrupt()
+{
+  mcp1.HandleInterrupt();
+}
+
+/**
+ * @brief Handles an interrupt from the second MCP.
+ *
+ */
+void OnMCP2Interrupt()
+{
+  mcp2.HandleInterrupt();
 }
 
 /**
@@ -143,7 +304,8 @@ void generateSerial(bool force)
 }
 
 /**
- * @brief Callback for handling a button press from a connected MCP.
+ * @brief Callback for handling a button press from a connected MCP. The press is
+ * queued and sent to MobiFlight from DrainEvents().
  *
  * @param state State of the button (pressed or released).
  * @param deviceAddress The I2C address of the MCP that detected the button event.
@@ -151,8 +313,6 @@ void generateSerial(bool force)
  */
 void OnButtonPress(ButtonState state, uint8_t deviceAddress, uint8_t button)
 {
-  auto isLongPress = false;
-
   // If the button was pushed on the second MCP then its button address
   // needs to have 16 added to it before doing the button name lookup.
   if (deviceAddress == MCP2_I2C_ADDRESS)
@@ -160,33 +320,51 @@ void OnButtonPress(ButtonState state, uint8_t deviceAddress, uint8_t button)
     button += 16;
   }
 
+  PushEvent(InputSource::kSourceExpander, button, state);
+}
+
+/**
+ * @brief Sends a key press from the MCPs to MobiFlight.
+ *
+ * @param event The key's event from the queue.
+ */
+void SendExpanderEvent(const InputEvent &event)
+{
+  auto isLongPress = false;
+  auto button = event.id;
+  auto state = static_cast<ButtonState>(event.state);
+
 #ifdef DEBUG
   Serial.print("Button: ");
   Serial.println(button);
 #endif
 
   // The data button and three mem buttons only send release events, and they are
-  // either regular or long press.
-  // 0 is DATA
-  // 6 is MEM_1
-  // 20 is MEM_3
-  // 28 is MEM_2
-  if (((button == 0) || (button == 6) || (button == 20) || (button == 28)))
+  // either regular or long press. Each one tracks its own press time since other
+  // buttons can be pressed and released while it is held.
+  for (auto i = 0; i < LONG_PRESS_BUTTON_COUNT; i++)
   {
+    if (button != LONG_PRESS_BUTTONS[i])
+    {
+      continue;
+    }
+
     // On the press event for these special case buttons just remember
     // when the press happened so the length of the press can be calculated
     // on release.
     if (state == ButtonState::Pressed)
     {
-      lastButtonPress = millis();
+      longPressStart[i] = event.time;
+      lastButtonPress = longPressStart[i];
       return;
     }
 
     // Check for a long press when released.
-    if ((millis() - lastButtonPress) > PRESS_AND_HOLD_LENGTH_MS)
+    if ((event.time - longPressStart[i]) > PRESS_AND_HOLD_LENGTH_MS)
     {
       isLongPress = true;
     }
+    break;
   }
 
   // The keyboard matrix provides a button location that has to
@@ -222,7 +400,7 @@ void OnButtonPress(ButtonState state, uint8_t deviceAddress, uint8_t button)
   cmdMessenger.sendCmdArg(state);
   cmdMessenger.sendCmdEnd();
 
-  lastButtonPress = millis();
+  lastButtonPress = event.time;
 }
 
 /**
@@ -257,61 +435,186 @@ void OnGetInfo()
   cmdMessenger.sendCmdArg(serial);
   cmdMessenger.sendCmdArg(VERSION);
   cmdMessenger.sendCmdEnd();
+
+  // MobiFlight asks for the board info first thing when it connects, which is
+  // the point the board became available.
+  if (!bootTimes[BootStage::kBootFirstInfo])
+  {
+    MarkBootStage(BootStage::kBootFirstInfo);
+#ifdef FAST_START
+    ledMatrix.Start();
+#endif
+  }
 }
 
-#ifdef DEBUG
 /**
- * @brief Generates the configuration string so it can be copied and pasted as a hardcoded string
- * in OnGetConfig().
+ * @brief Records the time a startup stage finished, relative to the start of setup().
+ * The time in microseconds wraps after about 71 minutes, and MobiFlight can connect
+ * later than that, so a stage that late is recorded as UINT32_MAX instead.
+ *
+ * @param stage The stage that finished.
  */
-void OnGenerateConfig()
+void MarkBootStage(BootStage stage)
 {
-  char singleModule[20] = "";
-  char pinName[ExpanderButtonNames::MaxNameLength] = "";
+  if (millis() - bootStartMillis >= UINT32_MAX / 1000)
+  {
+    bootTimes[stage] = UINT32_MAX;
+    return;
+  }
 
-  cmdMessenger.sendCmdStart(MFMessage::kInfo);
-  cmdMessenger.sendFieldSeparator();
+  bootTimes[stage] = micros() - bootStartMicros;
+}
 
-  // Send configuration for all the buttons. The virtual pins for the two MCP
-  // expansions start at 100 to avoid overlapping with the standard Arduino pins.
-  for (auto i = 0; i < ExpanderButtonNames::ButtonCount; i++)
+/**
+ * @brief Callback for sending the runtime statistics as a single kStats with, in order:
+ * commands received, commands sent, received commands lost to buffer overflow, unknown
+ * commands, input events lost to a full queue, low priority commands dropped, time spent
+ * blocked on serial output in microseconds, key events, encoder steps, the longest
+ * loop() pass in milliseconds, and then an address,count pair for each I2C device that
+ * has had failed transactions. The longest pass is timed from the loopMillis every pass
+ * already takes, so it's kept in every build. kGetLoopTimes has it in microseconds
+ * with LOOP_PROFILING.
+ *
+ */
+void OnGetStats()
+{
+  cmdMessenger.sendCmdStart(MFMessage::kStats);
+  cmdMessenger.sendCmdArg(cmdMessenger.getCommandsReceived());
+  cmdMessenger.sendCmdArg(cmdMessenger.getCommandsSent());
+  cmdMessenger.sendCmdArg(cmdMessenger.getOverflowResets());
+  cmdMessenger.sendCmdArg(cmdMessenger.getUnknownCommands());
+  cmdMessenger.sendCmdArg(inputEvents.Overflows());
+  cmdMessenger.sendCmdArg(cmdMessenger.getDroppedCommands());
+  cmdMessenger.sendCmdArg(cmdMessenger.getTxBlockedMicros());
+  cmdMessenger.sendCmdArg(keyEvents);
+  cmdMessenger.sendCmdArg(encoderSteps);
+  cmdMessenger.sendCmdArg(longestPassMillis);
+  for (auto slot = 0; slot < I2C_ERROR_SLOTS; slot++)
   {
-    // Get the pin name from flash
-    strcpy_P(pinName, (char *)pgm_read_word(&(ExpanderButtonNames::Names[i])));
-
-    snprintf(singleModule, 20, "%i.%i.%s:", MFDevice::kTypeButton, i + 100, pinName);
-    cmdMessenger.sendArg(singleModule);
+    auto count = i2c.ErrorCount(slot);
+    if (count)
+    {
+      cmdMessenger.sendCmdArg(i2c.ErrorAddress(slot));
+      cmdMessenger.sendCmdArg(count);
+    }
   }
+  cmdMessenger.sendCmdEnd();
+}
 
-  // Send configuration for the LED brightness output. 99 is the
-  // value of BRIGHTNESS_PIN.
-  cmdMessenger.sendArg(F("3.99.Brightness:"));
+#ifdef LOOP_PROFILING
+/**
+ * @brief Callback for sending the loop() timing histograms, one kLoopTimes per
+ * LoopStage as stage,longest,count0,count1,... with the times in microseconds.
+ * The histograms are cleared afterwards if the first argument is 1.
+ *
+ */
+void OnGetLoopTimes()
+{
+  auto reset = cmdMessenger.readInt16Arg() == 1;
 
-  // Send configuration five-way controller. The pin numbers are defined in
-  // PinAssignments.h but to save flash everything is brute force hard coded
-  // here.
-  cmdMessenger.sendArg(F("1.20.RIGHT:"));
-  cmdMessenger.sendArg(F("1.22.LEFT:"));
-  cmdMessenger.sendArg(F("1.21.UP:"));
-  cmdMessenger.sendArg(F("1.19.DOWN:"));
-  cmdMessenger.sendArg(F("1.18.CTR:"));
+  for (auto stage = 0; stage < LoopStage::LOOP_STAGE_COUNT; stage++)
+  {
+    cmdMessenger.sendCmdStart(MFMessage::kLoopTimes);
+    cmdMessenger.sendCmdArg(stage);
+    cmdMessenger.sendCmdArg(loopProfiler.Longest(stage));
+    for (auto bucket = 0; bucket < LOOP_PROFILE_BUCKETS; bucket++)
+    {
+      cmdMessenger.sendCmdArg(loopProfiler.Count(stage, bucket));
+    }
+    cmdMessenger.sendCmdEnd();
+  }
 
-  // Send configuration for the dual encoders. The 1 is the encoder type.
-  cmdMessenger.sendArg(F("8.8.5.1.ENC_1:"));
-  cmdMessenger.sendArg(F("8.9.10.1.ENC_2:"));
+  if (reset)
+  {
+    loopProfiler.Reset();
+  }
+}
+#endif
 
+/**
+ * @brief Callback for sending the startup timestamps, in microseconds since setup()
+ * started, in BootStage order. Stages that haven't happened yet are 0.
+ *
+ */
+void OnGetBootTimes()
+{
+  cmdMessenger.sendCmdStart(MFMessage::kBootTimes);
+  for (auto i = 0; i < BootStage::BOOT_STAGE_COUNT; i++)
+  {
+    cmdMessenger.sendCmdArg(bootTimes[i]);
+  }
   cmdMessenger.sendCmdEnd();
 }
-#endif
+
+/**
+ * @brief Sends the configuration for a single button as type.pin.name:
+ *
+ * @param pin The pin, or virtual pin, of the button.
+ * @param name The name of the button, stored in flash.
+ */
+void SendButtonConfig(uint8_t pin, const __FlashStringHelper *name)
+{
+  cmdMessenger.sendArg(MFDevice::kTypeButton);
+  cmdMessenger.sendArg('.');
+  cmdMessenger.sendArg(pin);
+  cmdMessenger.sendArg('.');
+  cmdMessenger.sendArg(name);
+  cmdMessenger.sendArg(':');
+}
 
 /**
  * @brief Callback for sending module configuration to MobiFlight.
- * The module configuration is generated on the fly rather than being stored in EEPROM.
+ * The module configuration is generated on the fly from the device tables in flash
+ * rather than being stored in EEPROM or RAM. CmdMessenger's transmit buffer sends
+ * it out in chunks as it fills.
  *
  */
 void OnGetConfig()
 {
-  Serial.println("10,1.100.RADAR_MENU:1.101.LWR_MENU:1.102.UPR_MENU:1.103.ESC:1.104.DATABASE:1.105.NAV_DATA:1.106.CAS_PAGE:1.107.CHART:1.108.CRSR:1.109.PASS_BRIEF:1.110.SYS:1.111.CKLIST:1.112.TFC:1.113.TERR_WX:1.114.ENG:1.115.ZOOM_PLUS:1.116.ZOOM_MINUS:1.117.MEM_1:1.118.MEM_2:1.119.MEM_3:1.120.DATA:1.121.MEM_1_LONG:1.122.MEM_2_LONG:1.123.MEM_3_LONG:1.124.DATA_LONG:3.99.Brightness:1.20.RIGHT:1.22.LEFT:1.21.UP:1.19.DOWN:1.18.CTR:8.8.5.2.ENC_1:8.9.10.2.ENC_2:;");
+  cmdMessenger.sendCmdStart(MFMessage::kInfo);
+  cmdMessenger.sendFieldSeparator();
+
+  // Send configuration for all the buttons. The virtual pins for the two MCP
+  // expansions start at 100 to avoid overlapping with the standard Arduino pins.
+  for (auto i = 0; i < ExpanderButtonNames::ButtonCount; i++)
+  {
+    SendButtonConfig(i + 100, (const __FlashStringHelper *)pgm_read_word(&(ExpanderButtonNames::Names[i])));
+  }
+
+  // Send configuration for the LED brightness output.
+  cmdMessenger.sendArg(MFDevice::kTypeOutput);
+  cmdMessenger.sendArg('.');
+  cmdMessenger.sendArg(BRIGHTNESS_PIN);
+  cmdMessenger.sendArg('.');
+  cmdMessenger.sendArg((const __FlashStringHelper *)BrightnessName);
+  cmdMessenger.sendArg(':');
+
+  // Send configuration for the five-way controller.
+  for (auto i = 0; i < MAX_BUTTONS; i++)
+  {
+    ButtonDefinition definition;
+    memcpy_P(&definition, &ButtonDefinitions[i], sizeof(definition));
+    SendButtonConfig(definition.pin, (const __FlashStringHelper *)definition.name);
+  }
+
+  // Send configuration for the dual encoders as type.pin1.pin2.encodertype.name:
+  for (auto i = 0; i < MAX_ENCODERS; i++)
+  {
+    EncoderDefinition definition;
+    memcpy_P(&definition, &EncoderDefinitions[i], sizeof(definition));
+    cmdMessenger.sendArg(MFDevice::kTypeEncoder);
+    cmdMessenger.sendArg('.');
+    cmdMessenger.sendArg(definition.pin1);
+    cmdMessenger.sendArg('.');
+    cmdMessenger.sendArg(definition.pin2);
+    cmdMessenger.sendArg('.');
+    cmdMessenger.sendArg(definition.type);
+    cmdMessenger.sendArg('.');
+    cmdMessenger.sendArg((const __FlashStringHelper *)definition.name);
+    cmdMessenger.sendArg(':');
+  }
+
+  cmdMessenger.sendCmdEnd();
 }
 
 /**
@@ -324,10 +627,13 @@ void OnSetPin()
   auto pin = cmdMessenger.readInt16Arg();
   auto state = cmdMessenger.readInt16Arg();
 
+  // The OK for a pin change carries nothing MobiFlight needs, so it's dropped
+  // rather than added to the backlog when MobiFlight isn't keeping up.
+
   // The brightness virtual pin is 69
   if (pin == BRIGHTNESS_PIN)
   {
-    cmdMessenger.sendCmd(kStatus, "OK");
+    cmdMessenger.sendLowPriorityCmd(kStatus, F("OK"));
     ledMatrix.SetBrightness(state);
     ledMatrix.SetPowerSaveMode(false);
   }
@@ -365,12 +671,14 @@ void OnSetName()
  */
 void CheckForPowerSave()
 {
-  if (!powerSavingMode && ((millis() - lastButtonPress) > (POWER_SAVING_TIME_SECS * 1000)))
+  auto idle = (loopMillis - lastButtonPress) > POWER_SAVING_TIME_MS;
+
+  if (!powerSavingMode && idle)
   {
     powerSavingMode = true;
     ledMatrix.SetPowerSaveMode(true);
   }
-  else if (powerSavingMode && ((millis() - lastButtonPress) < (POWER_SAVING_TIME_SECS * 1000)))
+  else if (powerSavingMode && !idle)
   {
     ledMatrix.SetPowerSaveMode(false);
     powerSavingMode = false;
@@ -383,20 +691,72 @@ void CheckForPowerSave()
  */
 void AddMFDevices()
 {
-  buttons[0] = MFButton(PIN_LEFT, F("LEFT"));
-  buttons[1] = MFButton(PIN_RIGHT, F("RIGHT"));
-  buttons[2] = MFButton(PIN_UP, F("UP"));
-  buttons[3] = MFButton(PIN_DOWN, F("DOWN"));
-  buttons[4] = MFButton(PIN_CTR, F("CTR"));
+  for (auto i = 0; i < MAX_BUTTONS; i++)
+  {
+    ButtonDefinition definition;
+    memcpy_P(&definition, &ButtonDefinitions[i], sizeof(definition));
+    buttons[i] = MFButton(definition.pin, (const __FlashStringHelper *)definition.name);
+  }
   MFButton::AttachHandler(HandlerOnButton);
 
-  encoders[0] = MFEncoder(PIN_A, PIN_B, 2, F("ENC_1"));
-  encoders[1] = MFEncoder(PIN_A_PRIME, PIN_B_PRIME, 2, F("ENC_2"));
+  for (auto i = 0; i < MAX_ENCODERS; i++)
+  {
+    EncoderDefinition definition;
+    memcpy_P(&definition, &EncoderDefinitions[i], sizeof(definition));
+    encoders[i] = MFEncoder(definition.pin1, definition.pin2, definition.type, (const __FlashStringHelper *)definition.name,
+                            definition.curve);
+  }
   MFEncoder::attachHandler(HandlerOnEncoder);
+
+  // Interrupts are only enabled once all the encoders exist since the
+  // interrupt handler ticks every one of them.
+  for (auto i = 0; i < MAX_ENCODERS; i++)
+  {
+    encoders[i].EnablePinChangeInterrupts();
+  }
 }
 
 /**
- * @brief Handles events from MobiFlight-style buttons.
+ * @brief Decodes encoder movement from a snapshot of the input pins. Must be called
+ * with interrupts disabled, and with a snapshot captured while they were disabled.
+ *
+ * @param pins The snapshot of the input pins.
+ */
+void TickEncoders(const PinSnapshot &pins, uint32_t currentMs)
+{
+  for (auto i = 0; i < MAX_ENCODERS; i++)
+  {
+    encoders[i].Tick(pins, currentMs);
+  }
+}
+
+/**
+ * @brief Decodes encoder movement as soon as an encoder pin changes. The pin change
+ * interrupts are shared by all the pins on a port so every encoder is ticked, which
+ * is harmless for the ones that didn't move.
+ *
+ */
+void OnEncoderPinChange()
+{
+  PinSnapshot pins;
+  pins.Capture();
+  TickEncoders(pins, millis());
+}
+
+ISR(PCINT0_vect)
+{
+  OnEncoderPinChange();
+}
+
+#ifdef PCINT2_vect
+ISR(PCINT2_vect)
+{
+  OnEncoderPinChange();
+}
+#endif
+
+/**
+ * @brief Handles events from MobiFlight-style buttons by queuing them for DrainEvents().
  *
  * @param eventId Whether the event is OnPress or OnRelease.
  * @param pin The button pin that fired the event.
@@ -404,38 +764,155 @@ void AddMFDevices()
  */
 void HandlerOnButton(uint8_t eventId, uint8_t pin, const __FlashStringHelper *name)
 {
-  cmdMessenger.sendCmdStart(MFMessage::kButtonChange);
-  cmdMessenger.sendCmdArg(name);
-  cmdMessenger.sendCmdArg(eventId);
-  cmdMessenger.sendCmdEnd();
-
-  lastButtonPress = millis();
+  PushEvent(InputSource::kSourceButton, pin, eventId);
 };
 
 /**
- * @brief Handles events from MF-style encoders
+ * @brief Handles events from MF-style encoders by queuing them for DrainEvents().
  *
  * @param eventId
  * @param pin The encoder pin that fired the event.
  * @param name The name of the encoder that fired the event.
+ * @param count The number of steps in the event.
+ */
+void HandlerOnEncoder(uint8_t eventId, uint8_t pin, const __FlashStringHelper *name, uint8_t count)
+{
+  PushEvent(InputSource::kSourceEncoder, pin, eventId, count);
+};
+
+/**
+ * @brief Queues an input event from the main loop. The LED interrupt pushes to the
+ * same queue, so it's held off while the event goes in to keep this the only producer.
+ *
+ * @param source Where the event came from.
+ * @param id The key, pin or other source specific id of the event.
+ * @param state The source specific state or event id.
+ * @param count The number of steps, for encoders.
  */
-void HandlerOnEncoder(uint8_t eventId, uint8_t pin, const __FlashStringHelper *name)
+void PushEvent(InputSource source, uint8_t id, uint8_t state, uint8_t count)
 {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    inputEvents.Push({loopMillis, source, id, state, count});
+  }
+}
+
+/**
+ * @brief Sends an MF-style button event to MobiFlight.
+ *
+ * @param event The button's event from the queue.
+ */
+void SendButtonEvent(const InputEvent &event)
+{
+  ButtonDefinition definition;
+  for (auto i = 0; i < MAX_BUTTONS; i++)
+  {
+    memcpy_P(&definition, &ButtonDefinitions[i], sizeof(definition));
+    if (definition.pin == event.id)
+    {
+      break;
+    }
+  }
+
+  cmdMessenger.sendCmdStart(MFMessage::kButtonChange);
+  cmdMessenger.sendCmdArg((const __FlashStringHelper *)definition.name);
+  cmdMessenger.sendCmdArg(event.state);
+  cmdMessenger.sendCmdEnd();
+
+  lastButtonPress = event.time;
+}
+
+/**
+ * @brief Sends an MF-style encoder event to MobiFlight. With MF_ENC_DELTA_MESSAGES
+ * defined the steps are sent as one kEncoderChange with the count as an extra argument.
+ * Stock MobiFlight doesn't understand the count, so by default the event is
+ * repeated once per step instead.
+ *
+ * @param event The encoder's event from the queue.
+ */
+void SendEncoderEvent(const InputEvent &event)
+{
+  EncoderDefinition definition;
+  for (auto i = 0; i < MAX_ENCODERS; i++)
+  {
+    memcpy_P(&definition, &EncoderDefinitions[i], sizeof(definition));
+    if (definition.pin1 == event.id || definition.pin2 == event.id)
+    {
+      break;
+    }
+  }
+  auto name = (const __FlashStringHelper *)definition.name;
+
+#ifdef MF_ENC_DELTA_MESSAGES
   cmdMessenger.sendCmdStart(MFMessage::kEncoderChange);
   cmdMessenger.sendCmdArg(name);
-  cmdMessenger.sendCmdArg(eventId);
+  cmdMessenger.sendCmdArg(event.state);
+  cmdMessenger.sendCmdArg(event.count);
   cmdMessenger.sendCmdEnd();
-};
+#else
+  for (auto i = 0; i < event.count; i++)
+  {
+    cmdMessenger.sendCmdStart(MFMessage::kEncoderChange);
+    cmdMessenger.sendCmdArg(name);
+    cmdMessenger.sendCmdArg(event.state);
+    cmdMessenger.sendCmdEnd();
+  }
+#endif
+}
+
+/**
+ * @brief Handles every queued input event. Key and encoder events are sent to
+ * MobiFlight and LED interrupts are passed on to the LED matrix.
+ *
+ */
+void DrainEvents()
+{
+  InputEvent event;
+  while (inputEvents.Pop(event))
+  {
+    switch (event.source)
+    {
+    case InputSource::kSourceExpander:
+      keyEvents++;
+      SendExpanderEvent(event);
+      break;
+    case InputSource::kSourceButton:
+      keyEvents++;
+      SendButtonEvent(event);
+      break;
+    case InputSource::kSourceEncoder:
+      encoderSteps += event.count;
+      SendEncoderEvent(event);
+      break;
+    case InputSource::kSourceLEDMatrix:
+      ledMatrix.HandleInterrupt();
+      break;
+    }
+  }
+}
 
 /**
  * @brief Loops through the MobiFlight-style buttons to check for button events.
  *
+ * @param pins The snapshot of the input pins to read the buttons from.
  */
-void ReadButtons()
+void ReadButtons(const PinSnapshot &pins)
 {
+  // Sample all the buttons, one bit each, so they can be debounced together.
+  uint8_t sample = 0xFF;
+  for (auto i = 0; i != MAX_BUTTONS; i++)
+  {
+    if (!pins.IsHigh(buttons[i]._location))
+    {
+      sample &= ~(1 << i);
+    }
+  }
+
+  auto states = buttonDebouncer.Update(sample);
+
   for (auto i = 0; i != MAX_BUTTONS; i++)
   {
-    buttons[i].Update();
+    buttons[i].Update(bitRead(states, i));
   }
 }
 
@@ -447,7 +924,7 @@ void ReadEncoders()
 {
   for (auto i = 0; i != MAX_ENCODERS; i++)
   {
-    encoders[i].Update();
+    encoders[i].Update(loopMillis);
   }
 }
 
@@ -457,22 +934,36 @@ void ReadEncoders()
  */
 void setup()
 {
+  bootStartMicros = micros();
+  bootStartMillis = millis();
   MFeeprom.init();
-  Wire.begin();
-  Wire.setClock(400000);
+  MarkBootStage(BootStage::kBootEEPROM);
+  i2c.Begin(400000);
+  MarkBootStage(BootStage::kBootI2C);
   Serial.begin(115200);
 
   attachCommandCallbacks();
   cmdMessenger.printLfCr();
+  cmdMessenger.bufferCommands();
+  MarkBootStage(BootStage::kBootSerial);
 
   OnResetBoard();
   AddMFDevices();
+  MarkBootStage(BootStage::kBootDevices);
   mcp1.Init();
   mcp2.Init();
+  MarkBootStage(BootStage::kBootExpanders);
   ledMatrix.Init();
+#ifndef FAST_START
+  // Building with -DFAST_START configures the ABM startup animation once
+  // MobiFlight first connects instead, so setup() finishes sooner.
+  ledMatrix.Start();
+#endif
+  MarkBootStage(BootStage::kBootLEDMatrix);
 
-  lastButtonPress = millis();
-  lastButtonUpdate = millis();
+  loopMillis = millis();
+  lastButtonPress = loopMillis;
+  lastButtonUpdate = loopMillis;
 }
 
 /**
@@ -481,19 +972,52 @@ void setup()
  */
 void loop()
 {
+  auto previousMillis = loopMillis;
+  loopMillis = millis();
+  if (loopMillis - previousMillis > longestPassMillis)
+  {
+    longestPassMillis = loopMillis - previousMillis;
+  }
+  PROFILE_START_PASS();
+
   cmdMessenger.feedinSerialData();
+  PROFILE_END_STAGE(LoopStage::kLoopSerial);
+  i2c.Loop();
+  PROFILE_END_STAGE(LoopStage::kLoopI2C);
 
-  // Buttons aren't checked every pass through the loop to
-  // handle button bouncing.
-  if (millis() - lastButtonUpdate >= BUTTON_DEBOUNCE_LENGTH_MS)
+  // Buttons are scanned at a fixed interval so the number of debounce
+  // samples maps to a fixed length of time.
+  if (loopMillis - lastButtonUpdate >= BUTTON_SCAN_INTERVAL_MS)
   {
-    mcp1.Loop();
-    mcp2.Loop();
-    ReadButtons();
+    mcp1.Loop(loopMillis);
+    mcp2.Loop(loopMillis);
+    PROFILE_END_STAGE(LoopStage::kLoopExpanders);
+
+    // The encoders are ticked in the same atomic block the pins are captured in
+    // so an encoder interrupt can't land in between and leave the snapshot stale.
+    PinSnapshot pins;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      pins.Capture();
+      TickEncoders(pins, loopMillis);
+    }
+
+    ReadButtons(pins);
+    PROFILE_END_STAGE(LoopStage::kLoopButtons);
     ReadEncoders();
-    lastButtonUpdate = millis();
+    PROFILE_END_STAGE(LoopStage::kLoopEncoders);
+    lastButtonUpdate = loopMillis;
   }
 
+  DrainEvents();
+  PROFILE_END_STAGE(LoopStage::kLoopEvents);
+
   CheckForPowerSave();
-  ledMatrix.Loop();
+  ledMatrix.Loop(loopMillis);
+  PROFILE_END_STAGE(LoopStage::kLoopLEDs);
+
+  // Everything sent during this pass goes out in one write.
+  cmdMessenger.flushCommands();
+  PROFILE_END_STAGE(LoopStage::kLoopFlush);
+  PROFILE_END_PASS();
 }
@@ -0,0 +1,289 @@
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#include "MockBoard.h"
+
+unsigned long mockMillis = 0;
+unsigned long mockMicros = 0;
+unsigned long mockMicrosPerCall = 0;
+
+bool mockPinLow[MOCK_PIN_COUNT];
+
+std::string mockSerialIn;
+std::string mockSerialOut;
+uint32_t mockSerialWrites = 0;
+int mockSerialWriteRoom = 64;
+
+volatile uint8_t MCUSR, SREG, TCNT1L, WDTCSR;
+volatile uint8_t PCICR, PCMSK0, PCMSK1, PCMSK2;
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+
+void mockResetI2C();
+
+void mockReset()
+{
+  mockMillis = 0;
+  mockMicros = 0;
+  mockMicrosPerCall = 0;
+  memset(mockPinLow, 0, sizeof(mockPinLow));
+  mockSerialIn.clear();
+  mockSerialOut.clear();
+  mockSerialWrites = 0;
+  mockSerialWriteRoom = 64;
+  mockResetI2C();
+}
+
+unsigned long millis()
+{
+  return mockMillis;
+}
+
+unsigned long micros()
+{
+  mockMicros += mockMicrosPerCall;
+  return mockMicros;
+}
+
+void delay(unsigned long ms)
+{
+  mockMillis += ms;
+  mockMicros += ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  mockMicros += us;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+int digitalRead(uint8_t pin)
+{
+  return pin < MOCK_PIN_COUNT && mockPinLow[pin] ? LOW : HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+}
+
+int analogRead(uint8_t pin)
+{
+  return 0;
+}
+
+long random(long max)
+{
+  return rand() % max;
+}
+
+long random(long min, long max)
+{
+  return min + rand() % (max - min);
+}
+
+void randomSeed(unsigned long seed)
+{
+  srand(seed);
+}
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(void), int mode)
+{
+}
+
+void detachInterrupt(uint8_t interrupt)
+{
+}
+
+size_t strlcpy(char *destination, const char *source, size_t size)
+{
+  auto length = strlen(source);
+  if (size)
+  {
+    auto copied = length < size - 1 ? length : size - 1;
+    memcpy(destination, source, copied);
+    destination[copied] = '\0';
+  }
+  return length;
+}
+
+// Port and bit of each Arduino pin on the ATmega32U4, matching PIN_LOCATIONS in PinSnapshot.h.
+static const char PinPorts[MOCK_PIN_COUNT + 1] = "DDDDDCDEBBBBDCBBBBFFFFFF";
+static const uint8_t PinBits[MOCK_PIN_COUNT] = {2, 3, 1, 0, 4, 6, 7, 6, 4, 5, 6, 7, 6, 7, 3, 1, 2, 0, 7, 6, 5, 4, 1, 0};
+
+uint8_t mockReadPort(char port)
+{
+  uint8_t value = 0xFF;
+  for (auto pin = 0; pin < MOCK_PIN_COUNT; pin++)
+  {
+    if (PinPorts[pin] == port && mockPinLow[pin])
+    {
+      value &= ~_BV(PinBits[pin]);
+    }
+  }
+  return value;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t written = 0;
+  while (size--)
+  {
+    written += write(*buffer++);
+  }
+  return written;
+}
+
+size_t Print::print(const __FlashStringHelper *value)
+{
+  return write(reinterpret_cast<const char *>(value));
+}
+
+size_t Print::print(const char value[])
+{
+  return write(value);
+}
+
+size_t Print::print(char value)
+{
+  return write(static_cast<uint8_t>(value));
+}
+
+size_t Print::print(unsigned char value, int base)
+{
+  return print(static_cast<unsigned long>(value), base);
+}
+
+size_t Print::print(int value, int base)
+{
+  return print(static_cast<long>(value), base);
+}
+
+size_t Print::print(unsigned int value, int base)
+{
+  return print(static_cast<unsigned long>(value), base);
+}
+
+size_t Print::print(long value, int base)
+{
+  char text[24];
+  snprintf(text, sizeof(text), base == HEX ? "%lX" : "%ld", value);
+  return write(text);
+}
+
+size_t Print::print(unsigned long value, int base)
+{
+  char text[24];
+  snprintf(text, sizeof(text), base == HEX ? "%lX" : "%lu", value);
+  return write(text);
+}
+
+size_t Print::print(double value, int digits)
+{
+  char text[32];
+  snprintf(text, sizeof(text), "%.*f", digits, value);
+  return write(text);
+}
+
+size_t Print::println(const __FlashStringHelper *value)
+{
+  return print(value) + println();
+}
+
+size_t Print::println(const char value[])
+{
+  return print(value) + println();
+}
+
+size_t Print::println(int value, int base)
+{
+  return print(value, base) + println();
+}
+
+size_t Print::println(unsigned long value, int base)
+{
+  return print(value, base) + println();
+}
+
+size_t Print::println()
+{
+  return write("\r\n");
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+  size_t count = 0;
+  while (count < length)
+  {
+    auto c = read();
+    if (c < 0)
+    {
+      break;
+    }
+    buffer[count++] = c;
+  }
+  return count;
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+}
+
+int HardwareSerial::available()
+{
+  return mockSerialIn.size();
+}
+
+int HardwareSerial::read()
+{
+  if (mockSerialIn.empty())
+  {
+    return -1;
+  }
+
+  auto c = static_cast<uint8_t>(mockSerialIn[0]);
+  mockSerialIn.erase(0, 1);
+  return c;
+}
+
+int HardwareSerial::peek()
+{
+  return mockSerialIn.empty() ? -1 : static_cast<uint8_t>(mockSerialIn[0]);
+}
+
+int HardwareSerial::availableForWrite()
+{
+  return mockSerialWriteRoom;
+}
+
+size_t HardwareSerial::write(uint8_t value)
+{
+  mockSerialOut += static_cast<char>(value);
+  mockSerialWrites++;
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  mockSerialOut.append(reinterpret_cast<const char *>(buffer), size);
+  mockSerialWrites++;
+  return size;
+}
+
+uint16_t EEPROMClass::length()
+{
+  return sizeof(mockEEPROM);
+}
+
+uint8_t EEPROMClass::read(int address)
+{
+  return mockEEPROM[address];
+}
+
+void EEPROMClass::write(int address, uint8_t value)
+{
+  mockEEPROM[address] = value;
+}
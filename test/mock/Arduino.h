@@ -0,0 +1,146 @@
+#pragma once
+
+// Stand-ins for the parts of the Arduino core the firmware uses, so it can be built
+// and tested on the host with `pio test -e native`. They model a Pro Micro
+// (env:micro). Tests drive and inspect them through MockBoard.h.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+
+#define __AVR_ATmega32U4__
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+
+#define A0 18
+#define A1 19
+#define A2 20
+#define A3 21
+#define A4 22
+#define A5 23
+
+static const uint8_t SDA = 2;
+static const uint8_t SCL = 3;
+
+#define bit(b) (1UL << (b))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+
+// The core's min() and max() are macros. These give the same result type without
+// clashing with the standard library headers the tests use.
+template <class T, class U>
+typename std::common_type<T, U>::type min(T a, U b)
+{
+  return a < b ? a : b;
+}
+
+template <class T, class U>
+typename std::common_type<T, U>::type max(T a, U b)
+{
+  return a > b ? a : b;
+}
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+int analogRead(uint8_t pin);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+// Only pins 2 and 3 have external interrupts, as on the nano, so the firmware's
+// polling fallbacks get exercised.
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : NOT_AN_INTERRUPT))
+void attachInterrupt(uint8_t interrupt, void (*handler)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+
+// Pins 8 to 11 are on PCINT4 to PCINT7, as on the Pro Micro.
+#define digitalPinToPCICR(p) (((p) >= 8 && (p) <= 11) ? (&PCICR) : ((volatile uint8_t *)0))
+#define digitalPinToPCICRbit(p) 0
+#define digitalPinToPCMSK(p) (((p) >= 8 && (p) <= 11) ? (&PCMSK0) : ((volatile uint8_t *)0))
+#define digitalPinToPCMSKbit(p) ((p) - 4)
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t value) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *str) { return write(reinterpret_cast<const uint8_t *>(str), strlen(str)); }
+  size_t write(const char *buffer, size_t size) { return write(reinterpret_cast<const uint8_t *>(buffer), size); }
+  virtual int availableForWrite() { return 0; }
+  virtual void flush() {}
+
+  size_t print(const __FlashStringHelper *value);
+  size_t print(const char value[]);
+  size_t print(char value);
+  size_t print(unsigned char value, int base = DEC);
+  size_t print(int value, int base = DEC);
+  size_t print(unsigned int value, int base = DEC);
+  size_t print(long value, int base = DEC);
+  size_t print(unsigned long value, int base = DEC);
+  size_t print(double value, int digits = 2);
+  size_t println(const __FlashStringHelper *value);
+  size_t println(const char value[]);
+  size_t println(int value, int base = DEC);
+  size_t println(unsigned long value, int base = DEC);
+  size_t println();
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  size_t readBytes(char *buffer, size_t length);
+};
+
+class HardwareSerial : public Stream
+{
+public:
+  void begin(unsigned long baud);
+  int available() override;
+  int read() override;
+  int peek() override;
+  int availableForWrite() override;
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
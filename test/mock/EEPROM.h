@@ -0,0 +1,25 @@
+#pragma once
+
+#include <Arduino.h>
+
+// 1KB of EEPROM, as on the ATmega32U4, held in RAM.
+class EEPROMClass
+{
+public:
+  EEPROMClass() { memset(mockEEPROM, 0xFF, sizeof(mockEEPROM)); }
+
+  uint16_t length();
+  uint8_t read(int address);
+  void write(int address, uint8_t value);
+
+  template <typename T>
+  const T &put(int address, const T &value)
+  {
+    memcpy(&mockEEPROM[address], &value, sizeof(T));
+    return value;
+  }
+
+  uint8_t mockEEPROM[1024];
+};
+
+extern EEPROMClass EEPROM;
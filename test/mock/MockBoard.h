@@ -0,0 +1,36 @@
+#pragma once
+
+#include <Arduino.h>
+#include <string>
+
+// Controls for the host stand-ins of the Arduino core, for use by the tests.
+
+// Time
+extern unsigned long mockMillis;        // Returned by millis().
+extern unsigned long mockMicros;        // Returned by micros().
+extern unsigned long mockMicrosPerCall; // Added to mockMicros on every call to micros(), so code waiting on it moves on.
+
+// Pins, by Arduino pin number. Every pin reads high unless it's set low here.
+static constexpr uint8_t MOCK_PIN_COUNT = 24;
+extern bool mockPinLow[MOCK_PIN_COUNT];
+
+// Serial
+extern std::string mockSerialIn;     // Bytes waiting to be read.
+extern std::string mockSerialOut;    // Every byte written.
+extern uint32_t mockSerialWrites;    // Number of write() calls made.
+extern int mockSerialWriteRoom;      // Returned by availableForWrite().
+
+// I2C bus. MCP23017s answer at 0x20 and 0x21 and the LED driver at 0x50.
+extern uint16_t mockExpanderInputs[2];   // GPIOB:GPIOA of each MCP23017, pressed buttons low.
+extern uint32_t mockExpanderReads[2];    // Number of reads from the GPIO registers of each MCP23017.
+extern int16_t mockI2CMissingAddress;    // A device that doesn't acknowledge, -1 for none.
+extern bool mockI2CStuck;                // Set to stop the bus from moving, as when a device holds SCL low.
+extern uint32_t mockI2CTransactions;     // Number of starts, repeated starts included.
+extern uint32_t mockI2CBytes;            // Number of bytes sent or received, addresses included.
+
+/**
+ * @brief Puts every stand-in back the way it was at reset, apart from the firmware's
+ * own state.
+ *
+ */
+void mockReset();
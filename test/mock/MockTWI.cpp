@@ -0,0 +1,170 @@
+#include <Arduino.h>
+#include <util/twi.h>
+
+#include "MockBoard.h"
+
+// Simulated I2C bus behind the TWI registers. Every write to TWCR with TWINT set
+// carries out the requested bus step straight away, and if TWIE is set the TWI
+// interrupt runs as soon as the write returns. Interrupts raised from inside the
+// interrupt are run in turn rather than nested.
+
+static constexpr uint8_t EXPANDER_ADDRESS = 0x20;
+static constexpr uint8_t LED_DRIVER_ADDRESS = 0x50;
+static constexpr uint8_t EXPANDER_GPIO_A = 0x12;
+
+uint16_t mockExpanderInputs[2];
+uint32_t mockExpanderReads[2];
+int16_t mockI2CMissingAddress;
+bool mockI2CStuck;
+uint32_t mockI2CTransactions;
+uint32_t mockI2CBytes;
+
+MockTWCR mockTWCR;
+volatile uint8_t TWSR, TWDR, TWBR, TWAR;
+
+extern "C" void TWI_vect(void);
+
+static bool busOwned;        // A start has been sent and no stop since.
+static bool addressNext;     // The next byte sent is a device address.
+static bool registerNext;    // The next byte written is a register address.
+static bool reading;         // The device was addressed for a read.
+static uint8_t address;      // Device being talked to.
+static uint8_t reg;          // Register pointer of the device being talked to.
+static bool inInterrupt;     // The TWI interrupt is running.
+static bool interruptRaised; // The TWI interrupt needs to run again.
+
+void mockResetI2C()
+{
+  mockExpanderInputs[0] = mockExpanderInputs[1] = 0xFFFF;
+  mockExpanderReads[0] = mockExpanderReads[1] = 0;
+  mockI2CMissingAddress = -1;
+  mockI2CStuck = false;
+  mockI2CTransactions = 0;
+  mockI2CBytes = 0;
+  busOwned = false;
+  mockTWCR.value = 0;
+}
+
+static bool IsExpander(uint8_t device)
+{
+  return device == EXPANDER_ADDRESS || device == EXPANDER_ADDRESS + 1;
+}
+
+static bool IsPresent(uint8_t device)
+{
+  return (IsExpander(device) || device == LED_DRIVER_ADDRESS) && device != mockI2CMissingAddress;
+}
+
+/**
+ * @brief Returns the next byte a device sends. The expanders are set up with
+ * IOCON.SEQOP, so their register pointer toggles between the A and B register of
+ * a pair.
+ *
+ */
+static uint8_t ReadDevice(bool first)
+{
+  if (!IsExpander(address))
+  {
+    return 0;
+  }
+
+  auto expander = address - EXPANDER_ADDRESS;
+  if (first && reg == EXPANDER_GPIO_A)
+  {
+    mockExpanderReads[expander]++;
+  }
+
+  uint8_t value = 0;
+  if ((reg & 0xFE) == EXPANDER_GPIO_A)
+  {
+    value = (reg & 1) ? mockExpanderInputs[expander] >> 8 : mockExpanderInputs[expander] & 0xFF;
+  }
+  reg ^= 1;
+  return value;
+}
+
+MockTWCR &MockTWCR::operator=(uint8_t control)
+{
+  // TWINT, TWSTA and TWSTO clear themselves once the step is done.
+  value = control & ~(_BV(TWINT) | _BV(TWSTA) | _BV(TWSTO));
+  if (!(control & _BV(TWINT)) || !(control & _BV(TWEN)) || mockI2CStuck)
+  {
+    return *this;
+  }
+
+  if (control & _BV(TWSTO))
+  {
+    busOwned = false;
+  }
+
+  if (control & _BV(TWSTA))
+  {
+    TWSR = busOwned ? TW_REP_START : TW_START;
+    busOwned = true;
+    addressNext = true;
+    mockI2CTransactions++;
+  }
+  else if (control & _BV(TWSTO))
+  {
+    // A stop on its own leaves the bus idle with no interrupt.
+    return *this;
+  }
+  else if (addressNext)
+  {
+    address = TWDR >> 1;
+    reading = TWDR & TW_READ;
+    addressNext = false;
+    registerNext = !reading;
+    mockI2CBytes++;
+
+    auto ack = IsPresent(address);
+    if (reading)
+    {
+      TWSR = ack ? TW_MR_SLA_ACK : TW_MR_SLA_NACK;
+    }
+    else
+    {
+      TWSR = ack ? TW_MT_SLA_ACK : TW_MT_SLA_NACK;
+    }
+  }
+  else if (!reading)
+  {
+    if (registerNext)
+    {
+      reg = TWDR;
+      registerNext = false;
+    }
+    else
+    {
+      reg++;
+    }
+    mockI2CBytes++;
+    TWSR = TW_MT_DATA_ACK;
+  }
+  else
+  {
+    // The first byte of a read is the one straight after the address.
+    auto first = TW_STATUS == TW_MR_SLA_ACK;
+    TWDR = ReadDevice(first);
+    mockI2CBytes++;
+    TWSR = (control & _BV(TWEA)) ? TW_MR_DATA_ACK : TW_MR_DATA_NACK;
+  }
+
+  value |= _BV(TWINT);
+  if (control & _BV(TWIE))
+  {
+    interruptRaised = true;
+    if (!inInterrupt)
+    {
+      inInterrupt = true;
+      while (interruptRaised)
+      {
+        interruptRaised = false;
+        TWI_vect();
+      }
+      inInterrupt = false;
+    }
+  }
+
+  return *this;
+}
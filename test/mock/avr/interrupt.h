@@ -0,0 +1,10 @@
+#pragma once
+
+#include <avr/io.h>
+
+// Interrupt handlers are plain functions on the host, so tests can call them to
+// simulate an interrupt.
+#define ISR(vector) extern "C" void vector(void)
+
+#define cli()
+#define sei()
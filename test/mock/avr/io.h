@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#define _BV(b) (1 << (b))
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+extern volatile uint8_t MCUSR, SREG, TCNT1L, WDTCSR;
+extern volatile uint8_t PCICR, PCMSK0, PCMSK1, PCMSK2;
+
+// Input port registers reflect the pin levels set through MockBoard.h.
+uint8_t mockReadPort(char port);
+#define PINB mockReadPort('B')
+#define PINC mockReadPort('C')
+#define PIND mockReadPort('D')
+#define PINE mockReadPort('E')
+#define PINF mockReadPort('F')
+
+// Writing TWCR runs a step of the simulated I2C bus in MockTWI.cpp.
+struct MockTWCR
+{
+  uint8_t value = 0;
+  MockTWCR &operator=(uint8_t control);
+  operator uint8_t() const { return value; }
+};
+extern MockTWCR mockTWCR;
+#define TWCR mockTWCR
+extern volatile uint8_t TWSR, TWDR, TWBR, TWAR;
+
+#define TWIE 0
+#define TWEN 2
+#define TWWC 3
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA 6
+#define TWINT 7
+
+#define WDE 3
+#define WDIE 6
+#define _WD_CONTROL_REG WDTCSR
+#define _WD_CHANGE_BIT 4
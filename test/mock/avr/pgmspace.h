@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// There's only one address space on the host, so PROGMEM reads are plain reads.
+#define PROGMEM
+#define PGM_P const char *
+
+#define pgm_read_byte(address) (*reinterpret_cast<const uint8_t *>(address))
+#define pgm_read_dword(address) (*reinterpret_cast<const uint32_t *>(address))
+#define pgm_read_ptr(address) (*reinterpret_cast<void *const *>(address))
+
+// Reads a word sized entry at its own type, since pointers are wider than a word on the host.
+template <typename T>
+T mockReadWord(const T *address)
+{
+  return *address;
+}
+#define pgm_read_word(address) mockReadWord(address)
+
+#define memcpy_P memcpy
+#define strcpy_P strcpy
+#define strlen_P strlen
+
+size_t strlcpy(char *destination, const char *source, size_t size);
@@ -0,0 +1,3 @@
+#pragma once
+
+#include <avr/io.h>
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Stand-in for the IS31FL3733 driver library with just the parts LEDMatrix uses.
+// Calls through the driver don't reach the simulated I2C bus. The LEDMatrix
+// framebuffer writes go through I2CEngine, so those do.
+namespace IS31FL3733
+{
+  static const uint8_t CS_LINES = 16;
+  static const uint8_t SW_LINES = 12;
+
+  static const uint8_t IMR_IAB = 0x08;
+  static const uint8_t ISR_ABM1 = 0x04;
+  static const uint8_t ISR_ABM2 = 0x08;
+  static const uint8_t ISR_ABM3 = 0x10;
+
+  enum class ADDR
+  {
+    GND = 0x00,
+    SCL = 0x01,
+    SDA = 0x02,
+    VCC = 0x03,
+  };
+
+  enum class COMMONREGISTER
+  {
+    IMR = 0xF0,
+    ISR = 0xF1,
+    PSR = 0xFD,
+    PSWL = 0xFE,
+  };
+
+  enum class LED_MODE
+  {
+    PWM = 0x00,
+    ABM1 = 0x01,
+    ABM2 = 0x02,
+    ABM3 = 0x03,
+  };
+
+  enum class ABM_NUM
+  {
+    NUM_1,
+    NUM_2,
+    NUM_3,
+  };
+
+  enum class ABM_T1
+  {
+    T1_210MS,
+  };
+
+  enum class ABM_T2
+  {
+    T2_210MS,
+  };
+
+  enum class ABM_T3
+  {
+    T3_210MS,
+  };
+
+  enum class ABM_T4
+  {
+    T4_210MS,
+  };
+
+  enum class ABM_LOOP_BEGIN
+  {
+    LOOP_BEGIN_T1,
+    LOOP_BEGIN_T2,
+    LOOP_BEGIN_T3,
+  };
+
+  enum class ABM_LOOP_END
+  {
+    LOOP_END_T3,
+    LOOP_END_T1,
+  };
+
+  struct ABM_CONFIG
+  {
+    ABM_T1 T1;
+    ABM_T2 T2;
+    ABM_T3 T3;
+    ABM_T4 T4;
+    ABM_LOOP_BEGIN Tbegin;
+    ABM_LOOP_END Tend;
+    uint16_t Times;
+  };
+
+  typedef uint8_t (*i2c_read_reg_func)(const uint8_t i2c_addr, const uint8_t reg_addr, uint8_t *buffer, const uint8_t count);
+  typedef uint8_t (*i2c_write_reg_func)(const uint8_t i2c_addr, const uint8_t reg_addr, const uint8_t *buffer, const uint8_t count);
+
+  class IS31FL3733Driver
+  {
+  public:
+    IS31FL3733Driver(ADDR addr1, ADDR addr2, i2c_read_reg_func read, i2c_write_reg_func write) {}
+    void Init() {}
+    void SetGCC(uint8_t gcc) {}
+    void ConfigABM(ABM_NUM n, ABM_CONFIG *config) {}
+    void StartABM() {}
+    void WriteCommonReg(COMMONREGISTER reg, uint8_t value) {}
+    uint8_t ReadCommonReg(COMMONREGISTER reg) { return 0; }
+  };
+}
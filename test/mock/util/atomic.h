@@ -0,0 +1,6 @@
+#pragma once
+
+// Nothing interrupts the host build, so an atomic block just runs once.
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+#define ATOMIC_BLOCK(type) for (bool mockAtomic = true; mockAtomic; mockAtomic = false)
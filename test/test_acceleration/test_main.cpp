@@ -0,0 +1,178 @@
+#include <unity.h>
+
+#include "EncoderAcceleration.h"
+
+// Encoder acceleration, replayed from recorded detent timing. Each trace is the
+// time between detents in milliseconds, as the pin change interrupt stamps them.
+
+static constexpr uint32_t TRACE_START_MS = 10000;
+
+static constexpr uint16_t SLOW_TRACE[] = {180, 175, 190, 182, 178, 185, 180, 176};
+static constexpr uint16_t FAST_TRACE[] = {16, 16, 17, 15, 16, 16, 16, 17, 16, 15, 16, 16};
+
+/**
+ * @brief Replays a trace and records the multiplier each detent would get.
+ *
+ * @param velocity The estimator to feed.
+ * @param ms The time of the previous detent, moved on to the last detent of the trace.
+ * @param trace The time between detents.
+ * @param length The number of detents.
+ * @param multipliers Set to the multiplier after each detent.
+ */
+void Replay(DetentVelocity &velocity, uint32_t &ms, const uint16_t *trace, uint8_t length, uint8_t *multipliers)
+{
+  for (uint8_t i = 0; i < length; i++)
+  {
+    ms += trace[i];
+    velocity.Detent(ms, 1);
+    multipliers[i] = GetAccelerationMultiplier(DefaultAccelerationCurve, velocity.Interval());
+  }
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_default_curve()
+{
+  TEST_ASSERT_EQUAL(8, GetAccelerationMultiplier(DefaultAccelerationCurve, 0));
+  TEST_ASSERT_EQUAL(8, GetAccelerationMultiplier(DefaultAccelerationCurve, 20));
+  TEST_ASSERT_EQUAL(4, GetAccelerationMultiplier(DefaultAccelerationCurve, 21));
+  TEST_ASSERT_EQUAL(4, GetAccelerationMultiplier(DefaultAccelerationCurve, 40));
+  TEST_ASSERT_EQUAL(2, GetAccelerationMultiplier(DefaultAccelerationCurve, 70));
+  TEST_ASSERT_EQUAL(1, GetAccelerationMultiplier(DefaultAccelerationCurve, 71));
+  TEST_ASSERT_EQUAL(1, GetAccelerationMultiplier(DefaultAccelerationCurve, DETENT_IDLE_INTERVAL_MS));
+  TEST_ASSERT_EQUAL(1, GetAccelerationMultiplier(DefaultAccelerationCurve, UINT16_MAX));
+}
+
+void test_custom_curve()
+{
+  static const AccelerationStep curve[] PROGMEM = {
+      {50, 3},
+      {UINT16_MAX, 1},
+  };
+
+  TEST_ASSERT_EQUAL(3, GetAccelerationMultiplier(curve, 50));
+  TEST_ASSERT_EQUAL(1, GetAccelerationMultiplier(curve, 51));
+}
+
+void test_first_detent_is_one_step()
+{
+  DetentVelocity velocity;
+  velocity.Detent(TRACE_START_MS, 1);
+
+  TEST_ASSERT_EQUAL(DETENT_IDLE_INTERVAL_MS, velocity.Interval());
+  TEST_ASSERT_EQUAL(1, GetAccelerationMultiplier(DefaultAccelerationCurve, velocity.Interval()));
+}
+
+void test_slow_turn_stays_at_one_step()
+{
+  DetentVelocity velocity;
+  uint32_t ms = TRACE_START_MS;
+  velocity.Detent(ms, 1);
+
+  uint8_t multipliers[sizeof(SLOW_TRACE) / sizeof(SLOW_TRACE[0])];
+  Replay(velocity, ms, SLOW_TRACE, sizeof(multipliers), multipliers);
+
+  for (auto multiplier : multipliers)
+  {
+    TEST_ASSERT_EQUAL(1, multiplier);
+  }
+}
+
+void test_fast_turn_ramps_up()
+{
+  DetentVelocity velocity;
+  uint32_t ms = TRACE_START_MS;
+  velocity.Detent(ms, 1);
+
+  uint8_t multipliers[sizeof(FAST_TRACE) / sizeof(FAST_TRACE[0])];
+  Replay(velocity, ms, FAST_TRACE, sizeof(multipliers), multipliers);
+
+  // The average takes a few detents to catch up, so the steps never jump
+  // straight from 1 to 8 and never go back down while the turn keeps up.
+  TEST_ASSERT_EQUAL(1, multipliers[0]);
+  for (uint8_t i = 1; i < sizeof(multipliers); i++)
+  {
+    TEST_ASSERT_GREATER_OR_EQUAL(multipliers[i - 1], multipliers[i]);
+    TEST_ASSERT_LESS_OR_EQUAL(multipliers[i - 1] * 2, multipliers[i]);
+  }
+  TEST_ASSERT_EQUAL(8, multipliers[7]);
+  TEST_ASSERT_EQUAL(8, multipliers[sizeof(multipliers) - 1]);
+}
+
+void test_pause_starts_over()
+{
+  DetentVelocity velocity;
+  uint32_t ms = TRACE_START_MS;
+  velocity.Detent(ms, 1);
+
+  uint8_t multipliers[sizeof(FAST_TRACE) / sizeof(FAST_TRACE[0])];
+  Replay(velocity, ms, FAST_TRACE, sizeof(multipliers), multipliers);
+
+  velocity.Detent(ms + DETENT_IDLE_INTERVAL_MS, 1);
+  TEST_ASSERT_EQUAL(DETENT_IDLE_INTERVAL_MS, velocity.Interval());
+}
+
+void test_reversal_starts_over()
+{
+  DetentVelocity velocity;
+  uint32_t ms = TRACE_START_MS;
+  velocity.Detent(ms, 1);
+
+  uint8_t multipliers[sizeof(FAST_TRACE) / sizeof(FAST_TRACE[0])];
+  Replay(velocity, ms, FAST_TRACE, sizeof(multipliers), multipliers);
+
+  velocity.Detent(ms + 16, -1);
+  TEST_ASSERT_EQUAL(DETENT_IDLE_INTERVAL_MS, velocity.Interval());
+}
+
+void test_early_stamp_counts_as_simultaneous()
+{
+  DetentVelocity velocity;
+  uint32_t ms = TRACE_START_MS;
+  velocity.Detent(ms, 1);
+
+  uint8_t multipliers[sizeof(FAST_TRACE) / sizeof(FAST_TRACE[0])];
+  Replay(velocity, ms, FAST_TRACE, sizeof(multipliers), multipliers);
+
+  // A detent from the main loop stamped with the start of the pass, a moment
+  // before the one the interrupt just stamped, isn't a wrap around.
+  auto interval = velocity.Interval();
+  velocity.Detent(ms - 2, 1);
+  TEST_ASSERT_EQUAL(interval / 2, velocity.Interval());
+
+  velocity.Detent(ms + 16, 1);
+  TEST_ASSERT_EQUAL(8, GetAccelerationMultiplier(DefaultAccelerationCurve, velocity.Interval()));
+}
+
+void test_millis_wrap_around()
+{
+  DetentVelocity velocity;
+  uint32_t ms = UINT32_MAX - 50;
+  velocity.Detent(ms, 1);
+
+  uint8_t multipliers[sizeof(FAST_TRACE) / sizeof(FAST_TRACE[0])];
+  Replay(velocity, ms, FAST_TRACE, sizeof(multipliers), multipliers);
+
+  TEST_ASSERT_EQUAL(8, multipliers[sizeof(multipliers) - 1]);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_default_curve);
+  RUN_TEST(test_custom_curve);
+  RUN_TEST(test_first_detent_is_one_step);
+  RUN_TEST(test_slow_turn_stays_at_one_step);
+  RUN_TEST(test_fast_turn_ramps_up);
+  RUN_TEST(test_pause_starts_over);
+  RUN_TEST(test_reversal_starts_over);
+  RUN_TEST(test_early_stamp_counts_as_simultaneous);
+  RUN_TEST(test_millis_wrap_around);
+  return UNITY_END();
+}
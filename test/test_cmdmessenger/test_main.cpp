@@ -0,0 +1,235 @@
+#include <unity.h>
+
+#include "CmdMessenger.h"
+#include "MockBoard.h"
+
+// Parsing of incoming commands. The argument table is built as the bytes arrive,
+// and the readXxxArg() functions have to give the same results as when the
+// arguments were tokenized on demand.
+
+CmdMessenger messenger(Serial);
+
+// What the last dispatched command held, read back by OnCommand(). The command ID
+// has already been read by the time the callback runs, so fields only holds the
+// arguments after it.
+static int commandCount;
+static int16_t commandId;
+static constexpr int MAX_COMMAND_IDS = 32;
+static int16_t commandIds[MAX_COMMAND_IDS]; // ID of each command dispatched, in order.
+static char fields[MAXARGUMENTS][MESSENGERBUFFERSIZE];
+static int fieldCount;
+
+void OnCommand()
+{
+  commandId = messenger.commandID();
+  if (commandCount < MAX_COMMAND_IDS)
+  {
+    commandIds[commandCount] = commandId;
+  }
+  commandCount++;
+
+  fieldCount = 0;
+  char *field;
+  while ((field = messenger.readStringArg()) != nullptr)
+  {
+    strlcpy(fields[fieldCount++], field, sizeof(fields[0]));
+  }
+}
+
+void Receive(const char *data)
+{
+  mockSerialIn += data;
+  while (mockSerialIn.size())
+  {
+    messenger.feedinSerialData();
+  }
+}
+
+void setUp()
+{
+  mockReset();
+  messenger.attach(OnCommand);
+  commandCount = 0;
+  fieldCount = 0;
+}
+
+void tearDown()
+{
+}
+
+void test_reads_integer_arguments()
+{
+  static int16_t pin, value;
+  static bool lastOk;
+  messenger.attach([]()
+                   {
+                     pin = messenger.readInt16Arg();
+                     value = messenger.readInt16Arg();
+                     messenger.readInt16Arg();
+                     lastOk = messenger.isArgOk();
+                   });
+
+  Receive("2,99,-64;");
+
+  TEST_ASSERT_EQUAL(2, messenger.commandID());
+  TEST_ASSERT_EQUAL(99, pin);
+  TEST_ASSERT_EQUAL(-64, value);
+  TEST_ASSERT_FALSE(lastOk);
+}
+
+void test_reads_each_argument_type()
+{
+  static int32_t longValue;
+  static bool boolValue;
+  static char charValue;
+  static float floatValue;
+  messenger.attach([]()
+                   {
+                     longValue = messenger.readInt32Arg();
+                     boolValue = messenger.readBoolArg();
+                     charValue = messenger.readCharArg();
+                     floatValue = messenger.readFloatArg();
+                   });
+
+  Receive("1,-70000,1,x,2.5;");
+
+  TEST_ASSERT_EQUAL(-70000, longValue);
+  TEST_ASSERT_TRUE(boolValue);
+  TEST_ASSERT_EQUAL('x', charValue);
+  TEST_ASSERT_TRUE(floatValue == 2.5f);
+}
+
+void test_reads_string_arguments()
+{
+  Receive("19,CJ4 MFD panel,SN-123;");
+
+  TEST_ASSERT_EQUAL(1, commandCount);
+  TEST_ASSERT_EQUAL(19, commandId);
+  TEST_ASSERT_EQUAL(2, fieldCount);
+  TEST_ASSERT_EQUAL_STRING("CJ4 MFD panel", fields[0]);
+  TEST_ASSERT_EQUAL_STRING("SN-123", fields[1]);
+}
+
+void test_escaped_separators_stay_in_their_field()
+{
+  Receive("19,a/,b,c/;d;");
+
+  TEST_ASSERT_EQUAL(1, commandCount);
+  TEST_ASSERT_EQUAL(2, fieldCount);
+  TEST_ASSERT_EQUAL_STRING("a/,b", fields[0]);
+  TEST_ASSERT_EQUAL_STRING("c/;d", fields[1]);
+
+  messenger.unescape(fields[0]);
+  TEST_ASSERT_EQUAL_STRING("a,b", fields[0]);
+}
+
+void test_empty_fields_are_skipped()
+{
+  Receive("11,,1.2.3:,;");
+
+  TEST_ASSERT_EQUAL(11, commandId);
+  TEST_ASSERT_EQUAL(1, fieldCount);
+  TEST_ASSERT_EQUAL_STRING("1.2.3:", fields[0]);
+}
+
+void test_command_split_across_reads()
+{
+  mockSerialIn = "2,9";
+  messenger.feedinSerialData();
+  TEST_ASSERT_EQUAL(0, commandCount);
+
+  mockSerialIn = "9,1;";
+  messenger.feedinSerialData();
+
+  TEST_ASSERT_EQUAL(1, commandCount);
+  TEST_ASSERT_EQUAL(2, fieldCount);
+  TEST_ASSERT_EQUAL_STRING("99", fields[0]);
+  TEST_ASSERT_EQUAL_STRING("1", fields[1]);
+}
+
+void test_fields_past_the_table_stay_in_the_last_one()
+{
+  // The command ID and 15 arguments fill the table, the rest end up in the 16th argument.
+  Receive("0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17;");
+
+  TEST_ASSERT_EQUAL(MAXARGUMENTS - 1, fieldCount);
+  TEST_ASSERT_EQUAL_STRING("14", fields[MAXARGUMENTS - 3]);
+  TEST_ASSERT_EQUAL_STRING("15,16,17", fields[MAXARGUMENTS - 2]);
+}
+
+void test_overlong_command_is_dropped()
+{
+  std::string command = "19,";
+  command.append(MESSENGERBUFFERSIZE, 'x');
+  command += ";2,99,1;";
+  Receive(command.c_str());
+
+  TEST_ASSERT_EQUAL(1, messenger.getOverflowResets());
+  TEST_ASSERT_EQUAL(2, commandId);
+  TEST_ASSERT_EQUAL_STRING("99", fields[0]);
+}
+
+void test_feed_dispatches_at_most_the_command_budget()
+{
+  // Short enough that the command budget runs out before the byte budget.
+  static constexpr int COMMANDS = MAXCOMMANDSPERFEED + 4;
+  for (auto i = 0; i < COMMANDS; i++)
+  {
+    mockSerialIn += std::to_string(10 + i) + ";";
+  }
+  TEST_ASSERT_LESS_OR_EQUAL(MAXBYTESPERFEED, mockSerialIn.size());
+
+  messenger.feedinSerialData();
+  TEST_ASSERT_EQUAL(MAXCOMMANDSPERFEED, commandCount);
+
+  messenger.feedinSerialData();
+  TEST_ASSERT_EQUAL(COMMANDS, commandCount);
+  for (auto i = 0; i < COMMANDS; i++)
+  {
+    TEST_ASSERT_EQUAL(10 + i, commandIds[i]);
+  }
+}
+
+void test_feed_processes_at_most_the_byte_budget()
+{
+  // Five 24 byte commands, more than the byte budget and the stream buffer hold.
+  static constexpr int COMMANDS = 5;
+  static constexpr int COMMAND_LENGTH = 24;
+  for (auto i = 0; i < COMMANDS; i++)
+  {
+    mockSerialIn += std::to_string(30 + i) + "," + std::string(COMMAND_LENGTH - 4, 'x') + ";";
+  }
+
+  messenger.feedinSerialData();
+  TEST_ASSERT_EQUAL(MAXBYTESPERFEED / COMMAND_LENGTH, commandCount);
+
+  // The bytes read from the port past the budget wait in the stream buffer.
+  TEST_ASSERT_EQUAL(COMMANDS * COMMAND_LENGTH - MAXSTREAMBUFFERSIZE, mockSerialIn.size());
+
+  messenger.feedinSerialData();
+  TEST_ASSERT_EQUAL(2 * MAXBYTESPERFEED / COMMAND_LENGTH, commandCount);
+
+  Receive("");
+  TEST_ASSERT_EQUAL(COMMANDS, commandCount);
+  for (auto i = 0; i < COMMANDS; i++)
+  {
+    TEST_ASSERT_EQUAL(30 + i, commandIds[i]);
+  }
+  TEST_ASSERT_EQUAL_STRING(std::string(COMMAND_LENGTH - 4, 'x').c_str(), fields[0]);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_reads_integer_arguments);
+  RUN_TEST(test_reads_each_argument_type);
+  RUN_TEST(test_reads_string_arguments);
+  RUN_TEST(test_escaped_separators_stay_in_their_field);
+  RUN_TEST(test_empty_fields_are_skipped);
+  RUN_TEST(test_command_split_across_reads);
+  RUN_TEST(test_fields_past_the_table_stay_in_the_last_one);
+  RUN_TEST(test_overlong_command_is_dropped);
+  RUN_TEST(test_feed_dispatches_at_most_the_command_budget);
+  RUN_TEST(test_feed_processes_at_most_the_byte_budget);
+  return UNITY_END();
+}
@@ -0,0 +1,170 @@
+#include <unity.h>
+
+#include "MFEncoder.h"
+#include "MockBoard.h"
+#include "PinAssignments.h"
+
+// Decoding the encoders from pin change interrupts. Every quadrature edge has to
+// be counted even when the main loop only gets round to the encoders long after
+// the edges happened.
+
+extern MFEncoder encoders[];
+
+void setup();
+void loop();
+extern "C" void PCINT0_vect(void);
+
+static constexpr uint8_t ENCODER_PIN_1 = 8;
+static constexpr uint8_t ENCODER_PIN_2 = 9;
+static constexpr uint8_t TWO_DETENTS_PER_CYCLE = 2;
+
+// Quadrature states in the order a clockwise turn goes through them, with bit 0
+// for pin 1 and bit 1 for pin 2 and a set bit meaning the pin is low.
+static constexpr uint8_t QUADRATURE[] = {0, 2, 3, 1};
+
+static uint8_t phase;
+static int16_t reportedSteps;
+
+extern "C" void OnEncoder(uint8_t eventId, uint8_t pin, const __FlashStringHelper *name, uint8_t count)
+{
+  reportedSteps += (eventId == encLeft || eventId == encLeftFast) ? count : -count;
+}
+
+/**
+ * @brief Moves an encoder one quadrature edge by setting its pins.
+ *
+ * @param pin1 The encoder's first pin.
+ * @param pin2 The encoder's second pin.
+ * @param direction 1 to go forward, -1 to go back.
+ */
+void Edge(uint8_t pin1, uint8_t pin2, int8_t direction)
+{
+  phase = (phase + direction) & 3;
+  mockPinLow[pin1] = QUADRATURE[phase] & 1;
+  mockPinLow[pin2] = QUADRATURE[phase] & 2;
+}
+
+void Tick(MFEncoder &encoder)
+{
+  PinSnapshot pins;
+  pins.Capture();
+  encoder.Tick(pins, mockMillis);
+}
+
+void setUp()
+{
+  mockReset();
+  phase = 0;
+  reportedSteps = 0;
+}
+
+void tearDown()
+{
+}
+
+void test_every_edge_counts()
+{
+  MFEncoder encoder(ENCODER_PIN_1, ENCODER_PIN_2, TWO_DETENTS_PER_CYCLE);
+
+  for (auto i = 0; i < 40 * 4; i++)
+  {
+    Edge(ENCODER_PIN_1, ENCODER_PIN_2, 1);
+    Tick(encoder);
+  }
+  TEST_ASSERT_EQUAL(80, encoder.GetPosition());
+
+  for (auto i = 0; i < 40 * 4; i++)
+  {
+    Edge(ENCODER_PIN_1, ENCODER_PIN_2, -1);
+    Tick(encoder);
+  }
+  TEST_ASSERT_EQUAL(0, encoder.GetPosition());
+}
+
+void test_ticks_between_updates_are_all_reported()
+{
+  MFEncoder encoder(ENCODER_PIN_1, ENCODER_PIN_2, TWO_DETENTS_PER_CYCLE);
+  MFEncoder::attachHandler(OnEncoder);
+
+  // Slow enough that every detent is worth one step.
+  for (auto i = 0; i < 10 * 4; i++)
+  {
+    mockMillis += 100;
+    Edge(ENCODER_PIN_1, ENCODER_PIN_2, 1);
+    Tick(encoder);
+    if (i % 8 == 7)
+    {
+      encoder.Update(mockMillis);
+    }
+  }
+
+  // Once more after a pause, for builds that hold steps back to combine them.
+  mockMillis += 100;
+  encoder.Update(mockMillis);
+
+  TEST_ASSERT_EQUAL(20, reportedSteps);
+  MFEncoder::attachHandler(nullptr);
+}
+
+void test_pin_change_interrupts_are_enabled()
+{
+  setup();
+
+  // Pin 5 has no pin change interrupt on the ATmega32U4 and is left to the scan.
+  TEST_ASSERT_EQUAL(_BV(PIN_A - 4) | _BV(PIN_A_PRIME - 4) | _BV(PIN_B_PRIME - 4), PCMSK0);
+  TEST_ASSERT_EQUAL(1, PCICR);
+}
+
+void test_fast_turn_between_loop_passes()
+{
+  setup();
+  loop();
+  auto start = encoders[1].GetPosition();
+
+  // 40 cycles on the second encoder with the loop only running every 20 edges,
+  // as when it's busy with serial or I2C work.
+  for (auto i = 0; i < 40 * 4; i++)
+  {
+    Edge(PIN_A_PRIME, PIN_B_PRIME, 1);
+    PCINT0_vect();
+    if (i % 20 == 19)
+    {
+      mockMillis += 5;
+      loop();
+    }
+  }
+
+  TEST_ASSERT_EQUAL(80, encoders[1].GetPosition() - start);
+}
+
+void test_scan_alone_misses_fast_turn()
+{
+  setup();
+  loop();
+  auto start = encoders[1].GetPosition();
+
+  // The same turn without the interrupt. Every 20 edges is five whole cycles, so
+  // the scan sees the pins back where they started.
+  for (auto i = 0; i < 40 * 4; i++)
+  {
+    Edge(PIN_A_PRIME, PIN_B_PRIME, 1);
+    if (i % 20 == 19)
+    {
+      mockMillis += 5;
+      loop();
+    }
+  }
+
+  TEST_ASSERT_EQUAL(0, encoders[1].GetPosition() - start);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_every_edge_counts);
+  RUN_TEST(test_ticks_between_updates_are_all_reported);
+  RUN_TEST(test_pin_change_interrupts_are_enabled);
+  RUN_TEST(test_fast_turn_between_loop_passes);
+  RUN_TEST(test_scan_alone_misses_fast_turn);
+  return UNITY_END();
+}
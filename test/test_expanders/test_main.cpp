@@ -0,0 +1,223 @@
+#include <unity.h>
+
+#include "ExpanderManager.h"
+#include "I2CEngine.h"
+#include "MockBoard.h"
+#include "PinAssignments.h"
+
+// Reading the MCP23017s. With INT wired to an external interrupt pin the bus stays
+// idle until the expander reports a change, and without it the inputs are polled
+// every 10 ms, as they were before INT wiring could be configured. Both have to
+// report the same presses and releases.
+
+static constexpr uint8_t EXPANDER_ADDRESS = 0x20;
+static constexpr uint8_t INTERRUPT_PIN = 2;          // INT0 on the stand-in.
+static constexpr uint8_t PLAIN_PIN = 4;              // Not an external interrupt pin.
+static constexpr unsigned long SCAN_INTERVAL_MS = 2; // BUTTON_SCAN_INTERVAL_MS in the firmware.
+
+struct ButtonEvent
+{
+  ButtonState state;
+  uint8_t address;
+  uint8_t button;
+};
+
+static ButtonEvent events[16];
+static uint8_t eventCount;
+
+extern "C" void OnInterrupt()
+{
+}
+
+extern "C" void OnButton(ButtonState state, uint8_t address, uint8_t button)
+{
+  if (eventCount < sizeof(events) / sizeof(events[0]))
+  {
+    events[eventCount] = {state, address, button};
+  }
+  eventCount++;
+}
+
+void Scan(ExpanderManager &expander, uint8_t scans)
+{
+  for (auto i = 0; i < scans; i++)
+  {
+    mockMillis += SCAN_INTERVAL_MS;
+    expander.Loop(mockMillis);
+    i2c.Loop();
+  }
+}
+
+void setUp()
+{
+  mockReset();
+  eventCount = 0;
+  i2c.Begin(400000);
+}
+
+void tearDown()
+{
+}
+
+void test_default_wiring_is_polled()
+{
+  TEST_ASSERT_EQUAL(MCP_INT_PIN_NONE, MCP1_INT_PIN);
+  TEST_ASSERT_EQUAL(MCP_INT_PIN_NONE, MCP2_INT_PIN);
+}
+
+void test_interrupt_mode_idles_without_changes()
+{
+  ExpanderManager expander(EXPANDER_ADDRESS, INTERRUPT_PIN, OnInterrupt, OnButton);
+  expander.Init();
+  Scan(expander, 20);
+
+  // Only the read that clears anything pending from before Init().
+  TEST_ASSERT_EQUAL(1, mockExpanderReads[0]);
+  TEST_ASSERT_EQUAL(0, eventCount);
+}
+
+void test_interrupt_mode_reports_press_and_release()
+{
+  ExpanderManager expander(EXPANDER_ADDRESS, INTERRUPT_PIN, OnInterrupt, OnButton);
+  expander.Init();
+  Scan(expander, 5);
+
+  mockExpanderInputs[0] = ~_BV(3);
+  expander.HandleInterrupt();
+  Scan(expander, 10);
+
+  TEST_ASSERT_EQUAL(1, eventCount);
+  TEST_ASSERT_EQUAL(ButtonState::Pressed, events[0].state);
+  TEST_ASSERT_EQUAL(EXPANDER_ADDRESS, events[0].address);
+  TEST_ASSERT_EQUAL(3, events[0].button);
+
+  // Reads stop once the debouncer has settled.
+  auto reads = mockExpanderReads[0];
+  Scan(expander, 10);
+  TEST_ASSERT_EQUAL(reads, mockExpanderReads[0]);
+
+  mockExpanderInputs[0] = 0xFFFF;
+  expander.HandleInterrupt();
+  Scan(expander, 10);
+
+  TEST_ASSERT_EQUAL(2, eventCount);
+  TEST_ASSERT_EQUAL(ButtonState::Released, events[1].state);
+  TEST_ASSERT_EQUAL(3, events[1].button);
+}
+
+void test_polled_mode_idles_every_10ms()
+{
+  ExpanderManager expander(EXPANDER_ADDRESS, MCP_INT_PIN_NONE, OnInterrupt, OnButton);
+  expander.Init();
+  Scan(expander, 50);
+
+  // 100 ms without a change is ten reads, not one per scan.
+  TEST_ASSERT_EQUAL(10, mockExpanderReads[0]);
+  TEST_ASSERT_EQUAL(0, eventCount);
+}
+
+void test_pin_without_interrupt_is_polled()
+{
+  ExpanderManager expander(EXPANDER_ADDRESS, PLAIN_PIN, OnInterrupt, OnButton);
+  expander.Init();
+  Scan(expander, 50);
+
+  TEST_ASSERT_EQUAL(10, mockExpanderReads[0]);
+}
+
+void test_polled_mode_reads_every_scan_while_debouncing()
+{
+  ExpanderManager expander(EXPANDER_ADDRESS, MCP_INT_PIN_NONE, OnInterrupt, OnButton);
+  expander.Init();
+  Scan(expander, 5);
+
+  // The next idle read sees the press, then every scan is read until it settles.
+  mockExpanderInputs[0] = ~_BV(9);
+  Scan(expander, 1);
+  auto reads = mockExpanderReads[0];
+  Scan(expander, DEBOUNCE_SAMPLES - 1);
+
+  TEST_ASSERT_EQUAL(reads + DEBOUNCE_SAMPLES - 1, mockExpanderReads[0]);
+  TEST_ASSERT_EQUAL(1, eventCount);
+  TEST_ASSERT_EQUAL(ButtonState::Pressed, events[0].state);
+  TEST_ASSERT_EQUAL(9, events[0].button);
+}
+
+void test_polled_mode_reports_press_and_release()
+{
+  ExpanderManager expander(EXPANDER_ADDRESS, MCP_INT_PIN_NONE, OnInterrupt, OnButton);
+  expander.Init();
+  Scan(expander, 5);
+
+  // Two buttons on different ports held together, with no interrupt raised.
+  mockExpanderInputs[0] = ~(_BV(0) | _BV(12));
+  Scan(expander, 10);
+
+  TEST_ASSERT_EQUAL(2, eventCount);
+  TEST_ASSERT_EQUAL(ButtonState::Pressed, events[0].state);
+  TEST_ASSERT_EQUAL(0, events[0].button);
+  TEST_ASSERT_EQUAL(ButtonState::Pressed, events[1].state);
+  TEST_ASSERT_EQUAL(12, events[1].button);
+
+  mockExpanderInputs[0] = ~_BV(12);
+  Scan(expander, 10);
+
+  TEST_ASSERT_EQUAL(3, eventCount);
+  TEST_ASSERT_EQUAL(ButtonState::Released, events[2].state);
+  TEST_ASSERT_EQUAL(0, events[2].button);
+}
+
+void test_bounce_is_ignored()
+{
+  ExpanderManager expander(EXPANDER_ADDRESS, MCP_INT_PIN_NONE, OnInterrupt, OnButton);
+  expander.Init();
+  Scan(expander, 5);
+
+  // Low for fewer scans than it takes to debounce.
+  for (auto i = 0; i < 5; i++)
+  {
+    mockExpanderInputs[0] = ~_BV(5);
+    Scan(expander, DEBOUNCE_SAMPLES - 1);
+    mockExpanderInputs[0] = 0xFFFF;
+    Scan(expander, 1);
+  }
+  Scan(expander, 10);
+
+  TEST_ASSERT_EQUAL(0, eventCount);
+}
+
+void test_failed_read_is_retried()
+{
+  ExpanderManager expander(EXPANDER_ADDRESS, INTERRUPT_PIN, OnInterrupt, OnButton);
+  expander.Init();
+  Scan(expander, 5);
+
+  mockI2CMissingAddress = EXPANDER_ADDRESS;
+  mockExpanderInputs[0] = ~_BV(7);
+  expander.HandleInterrupt();
+  Scan(expander, 5);
+  TEST_ASSERT_EQUAL(0, eventCount);
+
+  // The interrupt was consumed by the failed reads, but the press still comes through.
+  mockI2CMissingAddress = -1;
+  Scan(expander, 10);
+
+  TEST_ASSERT_EQUAL(1, eventCount);
+  TEST_ASSERT_EQUAL(ButtonState::Pressed, events[0].state);
+  TEST_ASSERT_EQUAL(7, events[0].button);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_default_wiring_is_polled);
+  RUN_TEST(test_interrupt_mode_idles_without_changes);
+  RUN_TEST(test_interrupt_mode_reports_press_and_release);
+  RUN_TEST(test_polled_mode_idles_every_10ms);
+  RUN_TEST(test_pin_without_interrupt_is_polled);
+  RUN_TEST(test_polled_mode_reads_every_scan_while_debouncing);
+  RUN_TEST(test_polled_mode_reports_press_and_release);
+  RUN_TEST(test_bounce_is_ignored);
+  RUN_TEST(test_failed_read_is_retried);
+  return UNITY_END();
+}
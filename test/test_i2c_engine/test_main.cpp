@@ -0,0 +1,216 @@
+#include <unity.h>
+
+#include "I2CEngine.h"
+#include "MockBoard.h"
+
+// The background I2C engine, run against the bus simulated in test/mock. The
+// simulated bus completes each step as soon as it's requested, so a transaction
+// submitted while the bus is free is finished by the time Submit() returns.
+
+static constexpr uint8_t EXPANDER_ADDRESS = 0x21;
+static constexpr uint8_t LED_DRIVER_ADDRESS = 0x50;
+static constexpr uint8_t GPIO_A = 0x12;
+
+static uint8_t callbackOrder[I2C_QUEUE_LENGTH * 2];
+static uint8_t callbackCount;
+static bool resubmit;
+
+extern "C" void RecordCallback(I2CTransaction *transaction)
+{
+  if (callbackCount < sizeof(callbackOrder))
+  {
+    callbackOrder[callbackCount] = *static_cast<uint8_t *>(transaction->context);
+  }
+  callbackCount++;
+
+  if (resubmit)
+  {
+    i2c.Submit(transaction);
+  }
+}
+
+/**
+ * @brief Returns the number of failed transactions counted for a device.
+ *
+ * @param address The device address.
+ */
+uint16_t ErrorsFor(uint8_t address)
+{
+  for (auto slot = 0; slot < I2C_ERROR_SLOTS; slot++)
+  {
+    if (i2c.ErrorCount(slot) && i2c.ErrorAddress(slot) == address)
+    {
+      return i2c.ErrorCount(slot);
+    }
+  }
+  return 0;
+}
+
+void setUp()
+{
+  mockReset();
+  callbackCount = 0;
+  resubmit = false;
+  i2c.Begin(400000);
+}
+
+void tearDown()
+{
+}
+
+void test_write()
+{
+  uint8_t values[] = {0x01, 0x02, 0x03};
+
+  TEST_ASSERT_TRUE(i2c.Write(LED_DRIVER_ADDRESS, 0x00, values, sizeof(values)));
+  TEST_ASSERT_EQUAL(1, mockI2CTransactions);
+  TEST_ASSERT_EQUAL(2 + sizeof(values), mockI2CBytes); // Address, register and data.
+}
+
+void test_read()
+{
+  uint8_t buffer[2] = {};
+  mockExpanderInputs[1] = 0xA55A;
+
+  TEST_ASSERT_TRUE(i2c.Read(EXPANDER_ADDRESS, GPIO_A, buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL_HEX8(0x5A, buffer[0]);
+  TEST_ASSERT_EQUAL_HEX8(0xA5, buffer[1]);
+  TEST_ASSERT_EQUAL(2, mockI2CTransactions); // Start, then a repeated start to read.
+  TEST_ASSERT_EQUAL(1, mockExpanderReads[1]);
+}
+
+void test_callbacks_run_from_loop_in_order()
+{
+  uint8_t ids[] = {0, 1, 2};
+  uint8_t buffer[sizeof(ids)][2];
+  I2CTransaction transactions[sizeof(ids)];
+
+  for (uint8_t i = 0; i < sizeof(ids); i++)
+  {
+    transactions[i] = {EXPANDER_ADDRESS, GPIO_A, buffer[i], 2, true, RecordCallback, &ids[i], I2CStatus::Idle};
+    TEST_ASSERT_TRUE(i2c.Submit(&transactions[i]));
+  }
+
+  TEST_ASSERT_EQUAL(I2CStatus::Done, transactions[2].status);
+  TEST_ASSERT_EQUAL(0, callbackCount);
+
+  i2c.Loop();
+
+  TEST_ASSERT_EQUAL(3, callbackCount);
+  TEST_ASSERT_EQUAL(0, callbackOrder[0]);
+  TEST_ASSERT_EQUAL(1, callbackOrder[1]);
+  TEST_ASSERT_EQUAL(2, callbackOrder[2]);
+}
+
+void test_missing_device_fails_and_is_counted()
+{
+  uint8_t value = 0;
+  auto errors = ErrorsFor(LED_DRIVER_ADDRESS);
+  mockI2CMissingAddress = LED_DRIVER_ADDRESS;
+
+  TEST_ASSERT_FALSE(i2c.Write(LED_DRIVER_ADDRESS, 0x00, &value, 1));
+  TEST_ASSERT_EQUAL(errors + 1, ErrorsFor(LED_DRIVER_ADDRESS));
+
+  // Other devices carry on as normal.
+  TEST_ASSERT_TRUE(i2c.Read(EXPANDER_ADDRESS, GPIO_A, &value, 1));
+}
+
+void test_full_queue_is_refused()
+{
+  I2CTransaction transactions[I2C_QUEUE_LENGTH + 1];
+  uint8_t value = 0;
+  mockI2CStuck = true;
+
+  for (auto i = 0; i < I2C_QUEUE_LENGTH + 1; i++)
+  {
+    transactions[i] = {LED_DRIVER_ADDRESS, 0x00, &value, 1, false, nullptr, nullptr, I2CStatus::Idle};
+  }
+
+  for (auto i = 0; i < I2C_QUEUE_LENGTH; i++)
+  {
+    TEST_ASSERT_TRUE(i2c.Submit(&transactions[i]));
+  }
+  TEST_ASSERT_FALSE(i2c.Submit(&transactions[I2C_QUEUE_LENGTH]));
+
+  // Once the bus is free again the stuck transaction times out and the rest go through.
+  mockI2CStuck = false;
+  mockMicros += I2C_TIMEOUT_US;
+  i2c.Loop();
+
+  TEST_ASSERT_EQUAL(I2CStatus::Failed, transactions[0].status);
+  for (auto i = 1; i < I2C_QUEUE_LENGTH; i++)
+  {
+    TEST_ASSERT_EQUAL(I2CStatus::Done, transactions[i].status);
+  }
+}
+
+void test_stuck_transfer_times_out()
+{
+  uint8_t value = 0;
+  auto errors = ErrorsFor(LED_DRIVER_ADDRESS);
+  mockI2CStuck = true;
+  mockMicrosPerCall = 10;
+
+  TEST_ASSERT_FALSE(i2c.Write(LED_DRIVER_ADDRESS, 0x00, &value, 1));
+  TEST_ASSERT_GREATER_OR_EQUAL(I2C_TIMEOUT_US, mockMicros);
+  TEST_ASSERT_LESS_OR_EQUAL(I2C_TIMEOUT_US + 1000, mockMicros);
+  TEST_ASSERT_EQUAL(errors + 1, ErrorsFor(LED_DRIVER_ADDRESS));
+
+  mockI2CStuck = false;
+  TEST_ASSERT_TRUE(i2c.Write(LED_DRIVER_ADDRESS, 0x00, &value, 1));
+}
+
+void test_stuck_background_read_fails()
+{
+  uint8_t id = 0;
+  uint8_t buffer[2];
+  I2CTransaction transaction{EXPANDER_ADDRESS, GPIO_A, buffer, 2, true, RecordCallback, &id, I2CStatus::Idle};
+  mockI2CStuck = true;
+
+  TEST_ASSERT_TRUE(i2c.Submit(&transaction));
+  i2c.Loop();
+  TEST_ASSERT_EQUAL(I2CStatus::Pending, transaction.status);
+
+  TEST_ASSERT_EQUAL(0, callbackCount);
+
+  // The callback hears about it the same way as a completed read.
+  mockMicros += I2C_TIMEOUT_US;
+  i2c.Loop();
+  TEST_ASSERT_EQUAL(I2CStatus::Failed, transaction.status);
+  TEST_ASSERT_EQUAL(1, callbackCount);
+
+  mockI2CStuck = false;
+  TEST_ASSERT_TRUE(i2c.Read(EXPANDER_ADDRESS, GPIO_A, buffer, 2));
+}
+
+void test_loop_runs_a_bounded_number_of_callbacks()
+{
+  uint8_t id = 0;
+  uint8_t buffer[2];
+  I2CTransaction transaction{EXPANDER_ADDRESS, GPIO_A, buffer, 2, true, RecordCallback, &id, I2CStatus::Idle};
+
+  // A callback that submits its transaction again always has another one waiting.
+  resubmit = true;
+  i2c.Submit(&transaction);
+  i2c.Loop();
+  TEST_ASSERT_EQUAL(I2C_QUEUE_LENGTH, callbackCount);
+
+  resubmit = false;
+  i2c.Loop();
+  i2c.Loop();
+  TEST_ASSERT_EQUAL(I2C_QUEUE_LENGTH + 1, callbackCount);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_write);
+  RUN_TEST(test_read);
+  RUN_TEST(test_callbacks_run_from_loop_in_order);
+  RUN_TEST(test_missing_device_fails_and_is_counted);
+  RUN_TEST(test_full_queue_is_refused);
+  RUN_TEST(test_stuck_transfer_times_out);
+  RUN_TEST(test_stuck_background_read_fails);
+  RUN_TEST(test_loop_runs_a_bounded_number_of_callbacks);
+  return UNITY_END();
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stdlib.h>
+
+// The receive side of CmdMessenger as it was before the argument table, kept as a
+// reference for the benchmark. Arguments are found by split_r() and findNext(),
+// which walk the command buffer again, checking escapes, for every argument read.
+// Only the parts needed to receive and read commands are kept.
+
+class LegacyParser
+{
+private:
+  enum
+  {
+    kProccesingMessage,
+    kEndOfMessage,
+    kProcessingArguments,
+  };
+
+  Stream *comms;
+  void (*callback)();
+  char commandBuffer[MESSENGERBUFFERSIZE];
+  char streamBuffer[MAXSTREAMBUFFERSIZE];
+  uint8_t bufferIndex;
+  uint8_t bufferLastIndex = MESSENGERBUFFERSIZE - 1;
+  uint8_t messageState;
+  uint8_t lastCommandId;
+  char CmdlastChar = '\0';
+  char ArglastChar = '\0';
+  char *current;
+  char *last;
+  bool dumped;
+  bool ArgOk;
+  const char field_separator = ',';
+  const char command_separator = ';';
+  const char escape_character = '/';
+
+  void reset()
+  {
+    bufferIndex = 0;
+    current = NULL;
+    last = NULL;
+    dumped = true;
+  }
+
+  uint8_t processLine(char serialChar)
+  {
+    messageState = kProccesingMessage;
+    bool escaped = isEscaped(&serialChar, escape_character, &CmdlastChar);
+    if ((serialChar == command_separator) && !escaped)
+    {
+      commandBuffer[bufferIndex] = 0;
+      if (bufferIndex > 0)
+      {
+        messageState = kEndOfMessage;
+        current = commandBuffer;
+        CmdlastChar = '\0';
+      }
+      reset();
+    }
+    else
+    {
+      commandBuffer[bufferIndex] = serialChar;
+      bufferIndex++;
+      if (bufferIndex >= bufferLastIndex)
+        reset();
+    }
+    return messageState;
+  }
+
+  void handleMessage()
+  {
+    lastCommandId = readInt16Arg();
+    if (callback != NULL)
+      (*callback)();
+  }
+
+  bool next()
+  {
+    char *temppointer = NULL;
+    switch (messageState)
+    {
+    case kProccesingMessage:
+      return false;
+    case kEndOfMessage:
+      temppointer = commandBuffer;
+      messageState = kProcessingArguments;
+    default:
+      if (dumped)
+        current = split_r(temppointer, field_separator, &last);
+      if (current != NULL)
+      {
+        dumped = true;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  int findNext(char *str, char delim)
+  {
+    int pos = 0;
+    bool escaped = false;
+    bool EOL = false;
+    ArglastChar = '\0';
+    while (true)
+    {
+      escaped = isEscaped(str, escape_character, &ArglastChar);
+      EOL = (*str == '\0' && !escaped);
+      if (EOL)
+      {
+        return pos;
+      }
+      if (*str == field_separator && !escaped)
+      {
+        return pos;
+      }
+      else
+      {
+        str++;
+        pos++;
+      }
+    }
+    return pos;
+  }
+
+  char *split_r(char *str, const char delim, char **nextp)
+  {
+    char *ret;
+    if (str == NULL)
+    {
+      str = *nextp;
+    }
+    while (findNext(str, delim) == 0 && *str)
+    {
+      str++;
+    }
+    if (*str == '\0')
+    {
+      return NULL;
+    }
+    ret = str;
+    str += findNext(str, delim);
+    if (*str)
+    {
+      *str++ = '\0';
+    }
+    *nextp = str;
+    return ret;
+  }
+
+  bool isEscaped(char *currChar, const char escapeChar, char *lastChar)
+  {
+    bool escaped;
+    escaped = (*lastChar == escapeChar);
+    *lastChar = *currChar;
+
+    if (*lastChar == escape_character && escaped)
+    {
+      *lastChar = '\0';
+    }
+    return escaped;
+  }
+
+public:
+  LegacyParser(Stream &stream, void (*newCallback)())
+  {
+    comms = &stream;
+    callback = newCallback;
+    reset();
+  }
+
+  void feedinSerialData()
+  {
+    while (comms->available())
+    {
+      size_t bytesAvailable = min(comms->available(), MAXSTREAMBUFFERSIZE);
+      comms->readBytes(streamBuffer, bytesAvailable);
+
+      for (size_t byteNo = 0; byteNo < bytesAvailable; byteNo++)
+      {
+        int messageState = processLine(streamBuffer[byteNo]);
+        if (messageState == kEndOfMessage)
+        {
+          handleMessage();
+        }
+      }
+    }
+  }
+
+  uint8_t commandID()
+  {
+    return lastCommandId;
+  }
+
+  int16_t readInt16Arg()
+  {
+    if (next())
+    {
+      dumped = true;
+      ArgOk = true;
+      return atoi(current);
+    }
+    ArgOk = false;
+    return 0;
+  }
+
+  char *readStringArg()
+  {
+    if (next())
+    {
+      dumped = true;
+      ArgOk = true;
+      return current;
+    }
+    ArgOk = false;
+    return NULL;
+  }
+};
@@ -0,0 +1,216 @@
+#include <unity.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <string>
+
+#include "CmdMessenger.h"
+#include "LegacyParser.h"
+#include "MockBoard.h"
+
+// Receiving MobiFlight traffic with the argument table against the split_r() and
+// findNext() parser it replaced. Both have to read the same commands and arguments
+// out of the trace, and the table should get there in less time.
+
+// The commands MobiFlight sends when it connects, followed by a run of brightness
+// changes on BRIGHTNESS_PIN, a power saving toggle and a rename with an escaped
+// separator.
+static const char *const TRACE[] = {
+    "9;",
+    "12;",
+    "16;",
+    "2,99,255;",
+    "2,99,240;",
+    "2,99,224;",
+    "2,99,208;",
+    "2,99,192;",
+    "2,99,176;",
+    "2,99,160;",
+    "2,99,144;",
+    "2,99,128;",
+    "18,1;",
+    "18,0;",
+    "2,99,128;",
+    "2,99,160;",
+    "2,99,192;",
+    "2,99,224;",
+    "2,99,255;",
+    "19,CJ4 MFD/, left;",
+    "23;",
+};
+static constexpr int TRACE_COMMANDS = sizeof(TRACE) / sizeof(TRACE[0]);
+static constexpr int BENCHMARK_PASSES = 5000; // Times through the trace per round.
+static constexpr int BENCHMARK_ROUNDS = 5;     // The fastest round of each parser is compared.
+
+/**
+ * @brief Serves the same bytes over and over without the cost of the serial stand-in.
+ *
+ */
+class TraceStream : public Stream
+{
+private:
+  std::string _data;
+  size_t _next = 0;
+
+public:
+  explicit TraceStream(const std::string &data) : _data(data) {}
+  void Rewind() { _next = 0; }
+  int available() override { return _data.size() - _next; }
+  int read() override { return _next < _data.size() ? static_cast<uint8_t>(_data[_next++]) : -1; }
+  int peek() override { return _next < _data.size() ? static_cast<uint8_t>(_data[_next]) : -1; }
+  size_t write(uint8_t value) override { return 1; }
+  using Print::write;
+};
+
+static std::string traceData;
+static TraceStream *stream;
+static CmdMessenger *messenger;
+static LegacyParser *legacy;
+
+// What each parser read from the trace, folded into one number.
+static uint32_t checksum;
+static int commandCount;
+
+/**
+ * @brief Reads a command's arguments the way the firmware's callbacks do and folds
+ * them into the checksum.
+ *
+ */
+template <typename Parser>
+void ReadCommand(Parser &parser)
+{
+  auto id = parser.commandID();
+  checksum = checksum * 31 + id;
+  commandCount++;
+
+  if (id == 2)
+  {
+    checksum = checksum * 31 + parser.readInt16Arg();
+    checksum = checksum * 31 + parser.readInt16Arg();
+  }
+  else if (id == 18)
+  {
+    checksum = checksum * 31 + parser.readInt16Arg();
+  }
+  else if (id == 19)
+  {
+    for (auto c = parser.readStringArg(); *c; c++)
+    {
+      checksum = checksum * 31 + *c;
+    }
+  }
+}
+
+void OnCommand()
+{
+  ReadCommand(*messenger);
+}
+
+void OnLegacyCommand()
+{
+  ReadCommand(*legacy);
+}
+
+/**
+ * @brief Runs the whole trace through the argument table parser.
+ *
+ */
+void ReceiveTrace()
+{
+  stream->Rewind();
+  auto expected = commandCount + TRACE_COMMANDS;
+  while (commandCount < expected)
+  {
+    messenger->feedinSerialData();
+  }
+}
+
+/**
+ * @brief Runs the whole trace through the old parser.
+ *
+ */
+void ReceiveTraceLegacy()
+{
+  stream->Rewind();
+  legacy->feedinSerialData();
+}
+
+void setUp()
+{
+  mockReset();
+  checksum = 0;
+  commandCount = 0;
+}
+
+void tearDown()
+{
+}
+
+void test_parsers_read_the_same_arguments()
+{
+  ReceiveTraceLegacy();
+  auto legacyChecksum = checksum;
+  TEST_ASSERT_EQUAL(TRACE_COMMANDS, commandCount);
+
+  checksum = 0;
+  commandCount = 0;
+  ReceiveTrace();
+  TEST_ASSERT_EQUAL(TRACE_COMMANDS, commandCount);
+  TEST_ASSERT_EQUAL(legacyChecksum, checksum);
+}
+
+/**
+ * @brief Times BENCHMARK_PASSES passes through the trace.
+ *
+ * @param receive Runs the trace through one of the parsers.
+ * @return double The time taken per command in nanoseconds.
+ */
+double TimeTrace(void (*receive)())
+{
+  auto start = std::chrono::steady_clock::now();
+  for (auto i = 0; i < BENCHMARK_PASSES; i++)
+  {
+    receive();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  return std::chrono::duration<double, std::nano>(elapsed).count() / BENCHMARK_PASSES / TRACE_COMMANDS;
+}
+
+void test_argument_table_is_faster()
+{
+  // The rounds alternate between the parsers so anything else running on the
+  // host slows both down alike.
+  auto legacyNs = TimeTrace(ReceiveTraceLegacy);
+  auto tableNs = TimeTrace(ReceiveTrace);
+  for (auto round = 1; round < BENCHMARK_ROUNDS; round++)
+  {
+    legacyNs = min(legacyNs, TimeTrace(ReceiveTraceLegacy));
+    tableNs = min(tableNs, TimeTrace(ReceiveTrace));
+  }
+  printf("split_r/findNext: %.1f ns per command, argument table: %.1f ns per command (%.2fx)\n",
+         legacyNs, tableNs, legacyNs / tableNs);
+
+  TEST_ASSERT_EQUAL(2 * BENCHMARK_ROUNDS * BENCHMARK_PASSES * TRACE_COMMANDS, commandCount);
+  TEST_ASSERT_TRUE(tableNs < legacyNs);
+}
+
+int main(int argc, char **argv)
+{
+  for (auto command : TRACE)
+  {
+    traceData += command;
+  }
+  TraceStream traceStream(traceData);
+  CmdMessenger tableParser(traceStream);
+  LegacyParser legacyParser(traceStream, OnLegacyCommand);
+  tableParser.attach(OnCommand);
+  stream = &traceStream;
+  messenger = &tableParser;
+  legacy = &legacyParser;
+
+  UNITY_BEGIN();
+  RUN_TEST(test_parsers_read_the_same_arguments);
+  RUN_TEST(test_argument_table_is_faster);
+  return UNITY_END();
+}
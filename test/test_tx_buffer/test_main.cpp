@@ -0,0 +1,123 @@
+#include <unity.h>
+
+#include "CmdMessenger.h"
+#include "MockBoard.h"
+#include "PinAssignments.h"
+
+// Sending through the transmit buffer. Each command, or each pass worth of held
+// commands, should reach the serial port in a single write() instead of one per
+// field or character.
+
+CmdMessenger messenger(Serial);
+
+void setup();
+void loop();
+
+void setUp()
+{
+  mockReset();
+  messenger.bufferCommands(false);
+  messenger.printLfCr(false);
+}
+
+void tearDown()
+{
+}
+
+void SendButtonChange(const char *name, int state)
+{
+  messenger.sendCmdStart(7);
+  messenger.sendCmdArg(name);
+  messenger.sendCmdArg(state);
+  messenger.sendCmdEnd();
+}
+
+void test_command_is_one_write()
+{
+  SendButtonChange("MEM_1", 0);
+
+  TEST_ASSERT_EQUAL(1, mockSerialWrites);
+  TEST_ASSERT_EQUAL_STRING("7,MEM_1,0;", mockSerialOut.c_str());
+}
+
+void test_newline_goes_in_the_same_write()
+{
+  messenger.printLfCr();
+  SendButtonChange("MEM_1", 1);
+
+  TEST_ASSERT_EQUAL(1, mockSerialWrites);
+  TEST_ASSERT_EQUAL_STRING("7,MEM_1,1;\r\n", mockSerialOut.c_str());
+}
+
+void test_held_commands_share_a_write()
+{
+  messenger.bufferCommands();
+  SendButtonChange("MEM_1", 0);
+  SendButtonChange("MEM_1", 1);
+  messenger.sendCmd(6, 2);
+
+  TEST_ASSERT_EQUAL(0, mockSerialWrites);
+
+  messenger.flushCommands();
+
+  TEST_ASSERT_EQUAL(1, mockSerialWrites);
+  TEST_ASSERT_EQUAL_STRING("7,MEM_1,0;7,MEM_1,1;6,2;", mockSerialOut.c_str());
+}
+
+void test_escaped_argument()
+{
+  char argument[] = "a,b;c/";
+  messenger.sendCmdStart(19);
+  messenger.sendCmdEscArg(argument);
+  messenger.sendCmdEnd();
+
+  TEST_ASSERT_EQUAL(1, mockSerialWrites);
+  TEST_ASSERT_EQUAL_STRING("19,a/,b/;c//;", mockSerialOut.c_str());
+}
+
+void test_command_longer_than_the_buffer()
+{
+  std::string argument(150, 'x');
+  messenger.sendCmdStart(10);
+  messenger.sendCmdArg(argument.c_str());
+  messenger.sendCmdEnd();
+
+  // The buffer goes out each time it fills, then the rest at the end.
+  TEST_ASSERT_EQUAL(3, mockSerialWrites);
+  TEST_ASSERT_EQUAL_STRING(("10," + argument + ";").c_str(), mockSerialOut.c_str());
+}
+
+void test_firmware_button_event_is_one_write()
+{
+  setup();
+  for (auto i = 0; i < 20; i++)
+  {
+    mockMillis++;
+    loop();
+  }
+  mockSerialOut.clear();
+  mockSerialWrites = 0;
+
+  // Press the center of the five-way button and give it time to debounce.
+  mockPinLow[PIN_CTR] = true;
+  for (auto i = 0; i < 20; i++)
+  {
+    mockMillis++;
+    loop();
+  }
+
+  TEST_ASSERT_EQUAL(1, mockSerialWrites);
+  TEST_ASSERT_EQUAL_STRING("7,CTR,0;\r\n", mockSerialOut.c_str());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_command_is_one_write);
+  RUN_TEST(test_newline_goes_in_the_same_write);
+  RUN_TEST(test_held_commands_share_a_write);
+  RUN_TEST(test_escaped_argument);
+  RUN_TEST(test_command_longer_than_the_buffer);
+  RUN_TEST(test_firmware_button_event_is_one_write);
+  return UNITY_END();
+}